@@ -0,0 +1,377 @@
+#include <zlib.h>
+
+namespace {
+
+// A log of header blocks, HPACK-encoded for size but still seekable: the
+// encoder starts over with an empty table every checkpoint_interval blocks,
+// so any block can be decoded starting from the checkpoint before it, and
+// ranges spanning several checkpoints can be decoded in parallel.
+//
+// Each segment (the blocks from one checkpoint to the next) is deflated on
+// top of that, as two streams that deflate better apart: the codes (each
+// block's length as an HPACK integer with an 8-bit prefix, then its
+// representations with string lengths but without the string bytes), and
+// the string bytes. Strings aren't Huffman-coded, deflate does better.
+//
+//   header:     "HPACKLOG", version, table size, checkpoint interval, 0
+//               (32-bit little endian each)
+//   segments:   per checkpoint, the raw and deflated size of the codes, the
+//               same for the strings (64-bit little endian each), and the
+//               deflated codes and strings
+//   index:      the offset of each segment (64-bit little endian)
+//   trailer:    index offset, block count (64-bit little endian), "HPACKEND"
+const char ARCHIVE_MAGIC[] = "HPACKLOG";
+const char ARCHIVE_END_MAGIC[] = "HPACKEND";
+const uint32_t ARCHIVE_VERSION = 2;
+const size_t ARCHIVE_HEADER_SIZE = 8 + 4 * 4;
+const size_t ARCHIVE_TRAILER_SIZE = 8 + 8 + 8;
+
+inline void put_le(string& out, uint64_t v, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; i++) {
+        out += (char)(uint8_t)(v >> (8 * i));
+    }
+}
+
+inline uint64_t get_le(const uint8_t *p, unsigned bytes)
+{
+    uint64_t v = 0;
+    for (unsigned i = 0; i < bytes; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// Copies one field representation (or size update) from pos to out, except
+// for the string bytes, which are copied with copy_string(pos, length).
+template <typename T>
+UnpackError copy_field(const uint8_t*& pos, const uint8_t* const end, string& out, T&& copy_string)
+{
+    const uint8_t *start = pos;
+    uint8_t b1 = *pos++;
+    unsigned v;
+    unsigned strings = 0;
+    UnpackError e;
+    if (b1 & 0x80) {
+        e = get_int(b1, mask(7), pos, end, v);
+    } else if (b1 & 0x40) {
+        e = get_int(b1, mask(6), pos, end, v);
+        strings = v ? 1 : 2;
+    } else if (b1 & 0x20) {
+        e = get_int(b1, mask(5), pos, end, v);
+    } else {
+        e = get_int(b1, mask(4), pos, end, v);
+        strings = v ? 1 : 2;
+    }
+    if (e) {
+        return e;
+    }
+    out.append((const char*)start, pos - start);
+    for (unsigned i = 0; i < strings; i++) {
+        if (pos == end) {
+            return UNPACK_TRUNCATED;
+        }
+        start = pos;
+        b1 = *pos++;
+        if ((e = get_int(b1, mask(7), pos, end, v))) {
+            return e;
+        }
+        out.append((const char*)start, pos - start);
+        if ((e = copy_string(pos, v))) {
+            return e;
+        }
+    }
+    return UNPACK_OK;
+}
+
+// Appends data deflated to out, after its raw and deflated size.
+inline void put_deflated(string& out, const string& data)
+{
+    uLongf length = compressBound(data.size());
+    string deflated(length, '\0');
+    int ret = compress2((Bytef*)&deflated[0], &length, (const Bytef*)data.data(), data.size(), Z_BEST_COMPRESSION);
+    assert(ret == Z_OK);
+    (void)ret;
+    put_le(out, data.size(), 8);
+    put_le(out, length, 8);
+    out.append(deflated, 0, length);
+}
+
+// Reads what put_deflated() wrote into out. Returns false if it's
+// truncated or corrupt.
+inline bool get_deflated(const uint8_t*& pos, const uint8_t* const end, string& out)
+{
+    if (end - pos < 16) {
+        return false;
+    }
+    uint64_t size = get_le(pos, 8);
+    uint64_t length = get_le(pos + 8, 8);
+    pos += 16;
+    // Deflate can't do better than about 1:1032, so anything claiming more
+    // is corrupt (and mustn't make us allocate that much).
+    if (length > (uint64_t)(end - pos) || size > length * 1032 + 64) {
+        return false;
+    }
+    out.resize(size);
+    uLongf out_length = size;
+    if (uncompress((Bytef*)&out[0], &out_length, pos, length) != Z_OK || out_length != size) {
+        return false;
+    }
+    pos += length;
+    return true;
+}
+
+class ArchiveWriter {
+    const PackState& proto;
+    const unsigned checkpoint_interval;
+    PackState state;
+    string output;
+    // The current segment's streams
+    string codes, strings;
+    vector<uint64_t> index;
+    uint64_t blocks;
+
+    void end_segment() {
+        index.push_back(output.size());
+        put_deflated(output, codes);
+        put_deflated(output, strings);
+        codes.clear();
+        strings.clear();
+    }
+
+public:
+    // Blocks are encoded with proto's settings, except for Huffman coding,
+    // with a table of table_size (which proto must also use).
+    ArchiveWriter(const PackState& proto, unsigned table_size, unsigned checkpoint_interval):
+        proto(proto), checkpoint_interval(checkpoint_interval),
+        state(proto.fork()), blocks(0) {
+        output.append(ARCHIVE_MAGIC, 8);
+        put_le(output, ARCHIVE_VERSION, 4);
+        put_le(output, table_size, 4);
+        put_le(output, checkpoint_interval, 4);
+        put_le(output, 0, 4);
+    }
+
+    // Returns false for a block with a field HTTP/2 can't carry.
+    bool add(const HeaderList& headers) {
+        if (blocks % checkpoint_interval == 0) {
+            debug("archive: checkpoint at block %zu\n", (size_t)blocks);
+            if (blocks) {
+                end_segment();
+            }
+            state = proto.fork();
+            state.huffman = false;
+        }
+        state.clear_output();
+        if (!state.pack_block(headers)) {
+            return false;
+        }
+        const string& block = state.get_output();
+        put_int(codes, 0, 8, block.size());
+        const uint8_t *pos = (const uint8_t*)block.data();
+        const uint8_t *const end = pos + block.size();
+        while (pos < end) {
+            UnpackError e = copy_field(pos, end, codes, [this](const uint8_t*& pos, unsigned length) {
+                strings.append((const char*)pos, length);
+                pos += length;
+                return UNPACK_OK;
+            });
+            // Our own encoder's output
+            assert(!e);
+            (void)e;
+        }
+        blocks++;
+        return true;
+    }
+
+    const string& finish() {
+        if (blocks) {
+            end_segment();
+        }
+        uint64_t index_offset = output.size();
+        for (uint64_t offset : index) {
+            put_le(output, offset, 8);
+        }
+        put_le(output, index_offset, 8);
+        put_le(output, blocks, 8);
+        output.append(ARCHIVE_END_MAGIC, 8);
+        return output;
+    }
+};
+
+// Reads an archive through mmap, so only the segments that are decoded are
+// read from disk.
+class ArchiveReader {
+    MappedFile file;
+    const uint8_t *data;
+    size_t size;
+    unsigned table_size;
+    unsigned checkpoint_interval;
+    const uint8_t *index;
+    size_t checkpoints;
+    uint64_t blocks;
+
+    const uint8_t *segment_start(size_t i) const {
+        return data + get_le(index + 8 * i, 8);
+    }
+
+    const uint8_t *segment_end(size_t i) const {
+        return i + 1 < checkpoints ? segment_start(i + 1) : index;
+    }
+
+    // Decodes the blocks [first, last) of segment i, calling
+    // callback(block, name, value) for each header and done(block) after
+    // each block.
+    template <typename T, typename U>
+    UnpackError decode_segment(size_t i, uint64_t first, uint64_t last, T&& callback, U&& done) const {
+        UnpackState state;
+        state.set_settings_table_size(table_size);
+        const uint8_t *segment = segment_start(i);
+        string codes, strings;
+        if (!get_deflated(segment, segment_end(i), codes) || !get_deflated(segment, segment_end(i), strings)) {
+            debug("archive: corrupt segment %zu\n", i);
+            return UNPACK_TRUNCATED;
+        }
+        const uint8_t *pos = (const uint8_t*)codes.data();
+        const uint8_t *const end = pos + codes.size();
+        string block_bytes;
+        const uint8_t *string_pos = (const uint8_t*)strings.data();
+        const uint8_t *const strings_end = string_pos + strings.size();
+        auto copy_string = [&](const uint8_t*&, unsigned length) {
+            if (length > (size_t)(strings_end - string_pos)) {
+                return UNPACK_TRUNCATED;
+            }
+            block_bytes.append((const char*)string_pos, length);
+            string_pos += length;
+            return UNPACK_OK;
+        };
+        const uint64_t segment_last = std::min<uint64_t>(last, (i + 1) * checkpoint_interval);
+        for (uint64_t block = i * checkpoint_interval; block < segment_last; block++) {
+            if (pos == end) {
+                return UNPACK_TRUNCATED;
+            }
+            uint8_t b1 = *pos++;
+            unsigned length;
+            if (UnpackError e = get_int(b1, mask(8), pos, end, length)) {
+                return e;
+            }
+            block_bytes.clear();
+            while (block_bytes.size() < length) {
+                if (pos == end) {
+                    return UNPACK_TRUNCATED;
+                }
+                if (UnpackError e = copy_field(pos, end, block_bytes, copy_string)) {
+                    return e;
+                }
+            }
+            if (block_bytes.size() != length) {
+                return UNPACK_TRUNCATED;
+            }
+            // Blocks before first are only decoded for the table.
+            state.feed(block_bytes);
+            UnpackError e;
+            if (block < first) {
+                e = state.unpack([](const string&, const string&) {});
+            } else {
+                e = state.unpack([&](const string& name, const string& value) {
+                    callback(block, name, value);
+                });
+            }
+            if (e) {
+                return e;
+            }
+            if (block >= first) {
+                done(block);
+            }
+        }
+        return UNPACK_OK;
+    }
+
+public:
+    ArchiveReader(): data(nullptr), size(0), table_size(0), checkpoint_interval(0),
+        index(nullptr), checkpoints(0), blocks(0) {}
+
+    // Returns false if the file can't be read or isn't a valid archive.
+    bool open(const char *path) {
+        if (!file.open(path) || file.get_size() < ARCHIVE_HEADER_SIZE + ARCHIVE_TRAILER_SIZE) {
+            return false;
+        }
+        data = file.get_data();
+        size = file.get_size();
+
+        const uint8_t *trailer = data + size - ARCHIVE_TRAILER_SIZE;
+        if (memcmp(data, ARCHIVE_MAGIC, 8) || get_le(data + 8, 4) != ARCHIVE_VERSION
+                || memcmp(trailer + 16, ARCHIVE_END_MAGIC, 8)) {
+            return false;
+        }
+        table_size = get_le(data + 12, 4);
+        checkpoint_interval = get_le(data + 16, 4);
+        uint64_t index_offset = get_le(trailer, 8);
+        blocks = get_le(trailer + 8, 8);
+        if (!checkpoint_interval || index_offset < ARCHIVE_HEADER_SIZE
+                || index_offset > size - ARCHIVE_TRAILER_SIZE) {
+            return false;
+        }
+        index = data + index_offset;
+        checkpoints = (trailer - index) / 8;
+        if ((trailer - index) % 8 || checkpoints != (blocks + checkpoint_interval - 1) / checkpoint_interval) {
+            return false;
+        }
+        for (size_t i = 0; i < checkpoints; i++) {
+            uint64_t offset = get_le(index + 8 * i, 8);
+            if (offset < ARCHIVE_HEADER_SIZE || offset > index_offset
+                    || (i && data + offset < segment_start(i - 1))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint64_t block_count() const {
+        return blocks;
+    }
+
+    size_t checkpoint_count() const {
+        return checkpoints;
+    }
+
+    // Decodes blocks [first, first + count) as text (headers and an empty
+    // line per block) into out. The segments involved are decoded in
+    // parallel, each from its checkpoint.
+    UnpackError extract(uint64_t first, uint64_t count, string& out) const {
+        if (first >= blocks) {
+            return UNPACK_OK;
+        }
+        // first + count may overflow, e.g. for all blocks from first
+        const uint64_t last = count > blocks - first ? blocks : first + count;
+        if (first == last) {
+            return UNPACK_OK;
+        }
+        const size_t first_segment = first / checkpoint_interval;
+        const size_t segments = (last - 1) / checkpoint_interval + 1 - first_segment;
+        vector<string> texts(segments);
+        vector<UnpackError> errors(segments, UNPACK_OK);
+        parallel_for(segments, [&](size_t s) {
+            string& text = texts[s];
+            errors[s] = decode_segment(first_segment + s, first, last,
+                [&text](uint64_t, const string& name, const string& value) {
+                    text += name;
+                    text += ": ";
+                    text += value;
+                    text += '\n';
+                }, [&text](uint64_t) {
+                    text += '\n';
+                });
+        });
+
+        for (size_t s = 0; s < segments; s++) {
+            if (errors[s]) {
+                return errors[s];
+            }
+            out += texts[s];
+        }
+        return UNPACK_OK;
+    }
+};
+
+} // namespace
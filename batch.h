@@ -0,0 +1,65 @@
+namespace {
+
+// Appends a frame of batch output: the connection id and the header block,
+// each preceded by its length as an HPACK integer with an 8-bit prefix.
+// get_frame() in unpack.h reads it back.
+void put_frame(string& out, const string& connection, const string& block)
+{
+    put_int(out, 0, 8, connection.size());
+    out += connection;
+    put_int(out, 0, 8, block.size());
+    out += block;
+}
+
+// Encodes the header blocks of many interleaved connections, as a server
+// would: each connection has its own encoder state (forked from proto), and
+// its blocks are encoded in order. Connections are independent, so they are
+// spread over threads. The output has one frame per block, in input order.
+class BatchPacker {
+    const PackState& proto;
+    const vector<ConnectionBlock>& blocks;
+    // Indices into blocks, by connection
+    vector<vector<size_t>> connections;
+
+public:
+    BatchPacker(const PackState& proto, const vector<ConnectionBlock>& blocks): proto(proto), blocks(blocks) {
+        map<string, size_t> ids;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            auto p = ids.insert(std::make_pair(blocks[i].connection, connections.size()));
+            if (p.second) {
+                connections.push_back(vector<size_t>());
+            }
+            connections[p.first->second].push_back(i);
+        }
+    }
+
+    // Returns false if a block has a field HTTP/2 can't carry.
+    bool pack(string& out) const {
+        vector<string> encoded(blocks.size());
+        std::atomic<bool> valid(true);
+        parallel_for(connections.size(), [&](size_t c) {
+            if (!valid) {
+                return;
+            }
+            PackState state = proto.fork();
+            for (size_t i : connections[c]) {
+                if (!state.pack_block(blocks[i].headers)) {
+                    valid = false;
+                    return;
+                }
+                encoded[i] = state.get_output();
+                state.clear_output();
+            }
+        });
+        if (!valid) {
+            return false;
+        }
+
+        for (size_t i = 0; i < blocks.size(); i++) {
+            put_frame(out, blocks[i].connection, encoded[i]);
+        }
+        return true;
+    }
+};
+
+} // namespace
@@ -1,10 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <deque>
 #include <map>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #ifndef LOG_DEBUG
 #define LOG_DEBUG 0
 #endif
@@ -22,13 +29,29 @@ using std::string;
 using std::vector;
 using std::pair;
 
+typedef pair<string, string> Header;
+typedef vector<Header> HeaderList;
+
 namespace {
 
+// Integer IDs for header names, so that users of the decoder can switch on
+// them instead of comparing strings. Names in the static table have the
+// index of their first static entry (e.g. 2 for :method), other well-known
+// names have IDs from FIRST_EXTRA_TOKEN, and NO_TOKEN means neither.
+typedef unsigned HeaderToken;
+const HeaderToken NO_TOKEN = 0;
+const HeaderToken FIRST_EXTRA_TOKEN = 64;
+
 struct TableEntry
 {
     string name, value;
+    HeaderToken token;
+    // Set when the entry is used as a full match, so the encoder can tell
+    // which entries were wasted when they get evicted.
+    bool referenced;
 
-    TableEntry(const string& name, const string& value): name(name), value(value) {}
+    TableEntry(const string& name, const string& value, HeaderToken token = NO_TOKEN):
+        name(name), value(value), token(token), referenced(false) {}
 
     unsigned size() const {
         return 32 + name.length() + value.length();
@@ -691,7 +714,7 @@ const size_t STATIC_TABLE_COUNT = sizeof(static_table) / sizeof(*static_table);
 // Indices 1..61 are static, meaning 62 is the first dynamic one.
 const unsigned dynamic_table_start = 62;
 
-const StaticTableEntry *find_first_static(string name)
+const StaticTableEntry *find_first_static(const string& name)
 {
     const auto end = static_table + STATIC_TABLE_COUNT;
     const char* cname = name.c_str();
@@ -719,25 +742,99 @@ size_t find_static(const string &name)
         return static_table_index(p);
     return 0;
 }
-size_t find_static(const string& name, const string& value)
+bool is_static_token(HeaderToken token)
 {
-    const auto end = static_table + STATIC_TABLE_COUNT;
-    if (auto p = find_first_static(name)) {
-        do {
-            if (!value.compare(get_static_value(*p))) {
-                return static_table_index(p);
-            }
-            p++;
-        } while (p < end && !name.compare(*p));
+    return token != NO_TOKEN && token < dynamic_table_start;
+}
+
+// Like find_static, but with the name already looked up.
+size_t find_static(HeaderToken token, const string& value)
+{
+    if (!is_static_token(token)) {
+        return 0;
     }
+    const auto end = static_table + STATIC_TABLE_COUNT;
+    const StaticTableEntry *p = static_table + token - 1;
+    const char *name = *p;
+    do {
+        if (!value.compare(get_static_value(*p))) {
+            return static_table_index(p);
+        }
+        p++;
+    } while (p < end && !strcmp(name, *p));
     return 0;
 }
 
+class HeaderTokens {
+    // Static table index => token for its name
+    HeaderToken static_tokens[dynamic_table_start];
+    map<string, HeaderToken> extra_tokens;
+    vector<string> extra_names;
+
+    HeaderTokens() {
+        static_tokens[0] = NO_TOKEN;
+        for (size_t i = 1; i < dynamic_table_start; i++) {
+            static_tokens[i] = find_static(static_table[i - 1]);
+        }
+        static const char *const well_known[] = {
+            "connection", "keep-alive", "proxy-connection", "upgrade", "te",
+            "origin", "priority", "pragma", "dnt", "x-requested-with",
+            "x-forwarded-for", "x-forwarded-proto", "x-request-id",
+            "traceparent", "tracestate", "upgrade-insecure-requests",
+        };
+        for (const char *name : well_known) {
+            add(name);
+        }
+    }
+
+public:
+    static HeaderTokens& get() {
+        static HeaderTokens tokens;
+        return tokens;
+    }
+
+    // Adds a well-known name, returning its token. Not thread safe: add
+    // names before starting any encoders or decoders.
+    HeaderToken add(const string& name) {
+        if (HeaderToken token = find(name)) {
+            return token;
+        }
+        HeaderToken token = FIRST_EXTRA_TOKEN + extra_names.size();
+        extra_names.push_back(name);
+        extra_tokens[name] = token;
+        return token;
+    }
+
+    HeaderToken find(const string& name) const {
+        if (size_t i = find_static(name)) {
+            return i;
+        }
+        auto p = extra_tokens.find(name);
+        return p != extra_tokens.end() ? p->second : NO_TOKEN;
+    }
+
+    HeaderToken static_token(unsigned index) const {
+        assert(index < dynamic_table_start);
+        return static_tokens[index];
+    }
+
+    const char *name(HeaderToken token) const {
+        if (is_static_token(token)) {
+            return static_table[token - 1];
+        } else if (token >= FIRST_EXTRA_TOKEN && token - FIRST_EXTRA_TOKEN < extra_names.size()) {
+            return extra_names[token - FIRST_EXTRA_TOKEN].c_str();
+        }
+        return nullptr;
+    }
+};
+
+// The token is compared first since that's cheaper than the name, and it's
+// only the same for different names if both are NO_TOKEN.
 template <class It>
-int find(string name, string value, It p, It end, int offset)
+int find(HeaderToken token, const string& name, const string& value, It p, It end, int offset)
 {
     for (size_t i = 0; p != end; p++, i++) {
-        if (p->name == name && p->value == value) {
+        if (p->token == token && p->name == name && p->value == value) {
             return i + offset;
         }
     }
@@ -745,10 +842,10 @@ int find(string name, string value, It p, It end, int offset)
 }
 
 template <class It>
-static int find(string name, It p, It end, int offset)
+static int find(HeaderToken token, const string& name, It p, It end, int offset)
 {
     for (size_t i = 0; p != end; p++, i++) {
-        if (p->name == name) {
+        if (p->token == token && p->name == name) {
             return i + offset;
         }
     }
@@ -760,38 +857,73 @@ struct DynamicTable
 {
     deque<TableEntry> table;
     unsigned size;
+    // Changes whenever an entry is added or evicted.
+    uint64_t generation;
     TableEntry dummy_entry;
 
-    DynamicTable(): size(0), dummy_entry("", "") {}
+    DynamicTable(): size(0), generation(0), dummy_entry("", "") {}
 
     void shrink(unsigned max_size) {
+        shrink(max_size, [](const TableEntry&) {});
+    }
+
+    template <typename T>
+    void shrink(unsigned max_size, T&& evicted) {
         while (size > max_size && table.size()) {
             TableEntry &e = table.back();
             debug("%u bytes over budget, evicting %s = %s for %u bytes\n", size - max_size, e.name.c_str(), e.value.c_str(), e.size());
+            evicted(e);
             size -= e.size();
             table.pop_back();
+            generation++;
         }
     }
 
     int find(const string& name, const string& value) {
-        if (int i = find_static(name, value)) {
-            return i;
-        } else {
-            return ::find(name, value, table.begin(), table.end(), dynamic_table_start);
-        }
+        return find(HeaderTokens::get().find(name), name, value);
     }
 
     int find(const string& name) {
-        if (int i = find_static(name)) {
+        return find(HeaderTokens::get().find(name), name);
+    }
+
+    // Lookups with the token for the name already known, which saves looking
+    // up the name in the static table.
+    int find(HeaderToken token, const string& name, const string& value) {
+        if (int i = find_static(token, value)) {
+            return i;
+        } else if (int i = ::find(token, name, value, table.begin(), table.end(), dynamic_table_start)) {
+            table[i - dynamic_table_start].referenced = true;
             return i;
+        }
+        return 0;
+    }
+
+    int find(HeaderToken token, const string& name) {
+        if (is_static_token(token)) {
+            return token;
         } else {
-            return ::find(name, table.begin(), table.end(), dynamic_table_start);
+            return ::find(token, name, table.begin(), table.end(), dynamic_table_start);
         }
     }
 
     void push(const string& name, const string& value) {
-        table.push_front(TableEntry(name, value));
+        push(HeaderTokens::get().find(name), name, value);
+    }
+
+    void push(HeaderToken token, const string& name, const string& value) {
+        table.push_front(TableEntry(name, value, token));
         size += table.front().size();
+        generation++;
+    }
+
+    // Fill the table with entries both ends have agreed on out of band, in
+    // the order they would have been added.
+    void prefill(const HeaderList& entries, unsigned max_size) {
+        for (const Header& h : entries) {
+            push(h.first, h.second);
+        }
+        shrink(max_size);
     }
 
     const char *get_name(unsigned i) {
@@ -804,10 +936,36 @@ struct DynamicTable
         }
     }
 
+    // The static table as TableEntry objects, built once.
+    static const vector<TableEntry>& static_entries() {
+        static const vector<TableEntry> entries = []() {
+            vector<TableEntry> entries;
+            for (size_t i = 0; i < STATIC_TABLE_COUNT; i++) {
+                const auto& entry = static_table[i];
+                entries.push_back(TableEntry(entry, get_static_value(entry), HeaderTokens::get().static_token(i + 1)));
+            }
+            return entries;
+        }();
+        return entries;
+    }
+
+    bool valid_index(unsigned i) const {
+        return 0 < i && i < dynamic_table_start + table.size();
+    }
+
+    HeaderToken get_token(unsigned i) {
+        if (0 < i && i < dynamic_table_start) {
+            return HeaderTokens::get().static_token(i);
+        } else if (dynamic_table_start <= i && i - dynamic_table_start < table.size()) {
+            return table[i - dynamic_table_start].token;
+        } else {
+            return NO_TOKEN;
+        }
+    }
+
     const TableEntry& get(unsigned i) {
         if (0 < i && i < dynamic_table_start) {
-            const auto& entry = static_table[i - 1];
-            return dummy_entry = TableEntry(entry, get_static_value(entry));
+            return static_entries()[i - 1];
         } else if (dynamic_table_start <= i && i - dynamic_table_start < table.size()) {
             return table[i - dynamic_table_start];
         } else {
@@ -819,6 +977,103 @@ struct DynamicTable
     }
 };
 
+// Calls f(i) for each i in [0, n), spread over up to one thread per CPU. The
+// calling thread does its share, so n = 1 starts no thread at all.
+template <typename F>
+void parallel_for(size_t n, F&& f)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < n; ) {
+            f(i);
+        }
+    };
+    const size_t count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n);
+    vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+// xorshift64, so that the same seed gives the same results everywhere.
+class Random {
+    uint64_t state;
+
+public:
+    explicit Random(uint64_t seed): state(seed ? seed : 1) {}
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // true with the given probability in percent
+    bool percent(unsigned p) {
+        return next() % 100 < p;
+    }
+};
+
+// FNV-1a, for the caches.
+inline uint32_t hash_bytes(const char *p, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The last few header blocks that didn't change the dynamic table. Seeing the
+// same block again with the table in the same state (same generation) means
+// the result is the same too, so all the per-field work can be skipped.
+template <typename Key, typename Value>
+class BlockCache
+{
+    struct Entry {
+        Key key;
+        Value value;
+        uint64_t generation;
+        bool valid;
+
+        Entry(): generation(0), valid(false) {}
+    };
+
+    static const size_t SIZE = 4;
+    Entry entries[SIZE];
+    size_t next;
+
+public:
+    size_t hits, misses;
+
+    BlockCache(): next(0), hits(0), misses(0) {}
+
+    const Value *find(const Key& key, uint64_t generation) {
+        for (const Entry& e : entries) {
+            if (e.valid && e.generation == generation && e.key == key) {
+                hits++;
+                return &e.value;
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+
+    void insert(const Key& key, const Value& value, uint64_t generation) {
+        Entry& e = entries[next];
+        next = (next + 1) % SIZE;
+        e.key = key;
+        e.value = value;
+        e.generation = generation;
+        e.valid = true;
+    }
+};
+
 static string read_fully(FILE *fp)
 {
     string t;
@@ -831,4 +1086,132 @@ static string read_fully(FILE *fp)
     return t;
 }
 
+inline bool read_file(const char *path, string& contents)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    contents = read_fully(fp);
+    fclose(fp);
+    return true;
+}
+
+// A whole file mapped read-only, for formats that are read in place.
+class MappedFile {
+    const uint8_t *data;
+    size_t size;
+
+public:
+    MappedFile(): data(nullptr), size(0) {}
+
+    ~MappedFile() {
+        if (data) {
+            munmap((void*)data, size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *p = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+        close(fd);
+        if (p == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = (const uint8_t*)p;
+        return true;
+    }
+
+    const uint8_t *get_data() const {
+        return data;
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+};
+
+// Parses a "name: value" line (without the newline).
+inline Header parse_header_line(const char *start, const char *end)
+{
+    const char *name_end = strchr(start + 1, ':');
+    const char *value_start = name_end + 1;
+    value_start += strspn(value_start, " ");
+
+    debug("\nparsed %.*s = %.*s\n", (int)(name_end - start), start, (int)(end - value_start), value_start);
+    return Header(string(start, name_end), string(value_start, end));
+}
+
+// Parses "name: value" lines, with an empty line ending each header block.
+inline vector<HeaderList> parse_header_blocks(const string& input)
+{
+    vector<HeaderList> blocks(1);
+    const char *pos = input.c_str();
+    const char *input_end = pos + input.length();
+    while (*pos) {
+        const char *start = pos;
+        const char *end = strchr(start, '\n');
+        pos = end ? end + 1 : input_end;
+        if (start == end) {
+            if (blocks.back().size()) {
+                blocks.push_back(HeaderList());
+            }
+            continue;
+        }
+        blocks.back().push_back(parse_header_line(start, end ? end : input_end));
+    }
+    if (blocks.back().empty()) {
+        blocks.pop_back();
+    }
+    return blocks;
+}
+
+// A header block on one of many connections, e.g. from a server log.
+struct ConnectionBlock {
+    string connection;
+    HeaderList headers;
+};
+
+// Like parse_header_blocks, but a block may start with a line "@id" with the
+// id of its connection. Blocks without one are on connection "".
+inline vector<ConnectionBlock> parse_connection_blocks(const string& input)
+{
+    vector<ConnectionBlock> blocks(1);
+    const char *pos = input.c_str();
+    const char *input_end = pos + input.length();
+    while (*pos) {
+        const char *start = pos;
+        const char *end = strchr(start, '\n');
+        pos = end ? end + 1 : input_end;
+        if (start == end) {
+            if (blocks.back().headers.size()) {
+                blocks.push_back(ConnectionBlock());
+            }
+            continue;
+        }
+        if (*start == '@' && blocks.back().headers.empty()) {
+            blocks.back().connection.assign(start + 1, end ? end : input_end);
+            continue;
+        }
+        blocks.back().headers.push_back(parse_header_line(start, end ? end : input_end));
+    }
+    if (blocks.back().headers.empty()) {
+        blocks.pop_back();
+    }
+    return blocks;
+}
+
 }
@@ -0,0 +1,132 @@
+namespace {
+
+// Encoder settings that can be tuned per deployment (see htune), read from a
+// text file with one setting per line:
+//
+//   table_size 4096
+//   max_entry_percent 75
+//   default_policy index|name|literal|never
+//   volatility on|off
+//   policy <name> index|name|literal|never
+//
+// Empty lines and lines starting with '#' are ignored.
+struct EncoderConfig {
+    unsigned table_size;
+    unsigned max_entry_percent;
+    IndexPolicy default_policy;
+    bool volatility;
+    vector<std::pair<string, IndexPolicy>> policies;
+
+    // PackState's defaults
+    EncoderConfig(): table_size(4096), max_entry_percent(75), default_policy(INDEX), volatility(true) {}
+
+    // On failure, line is the number of the offending line.
+    bool parse(const string& text, size_t& line) {
+        line = 0;
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == string::npos) {
+                end = text.size();
+            }
+            line++;
+            vector<string> words = split(text.substr(start, end - start));
+            start = end + 1;
+            if (words.empty() || words[0][0] == '#') {
+                continue;
+            }
+            if (!parse_setting(words)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    string format() const {
+        string out;
+        char line[64];
+        snprintf(line, sizeof(line), "table_size %u\n", table_size);
+        out += line;
+        snprintf(line, sizeof(line), "max_entry_percent %u\n", max_entry_percent);
+        out += line;
+        out += "default_policy ";
+        out += index_policy_name(default_policy);
+        out += volatility ? "\nvolatility on\n" : "\nvolatility off\n";
+        for (const auto& p : policies) {
+            out += "policy " + p.first + " " + index_policy_name(p.second) + "\n";
+        }
+        return out;
+    }
+
+    // The table size is still limited by the peer's settings.
+    void apply(PackState& state) const {
+        state.set_table_size(table_size);
+        state.max_entry_percent = max_entry_percent;
+        state.policy.default_policy = default_policy;
+        state.volatility.enabled = volatility;
+        for (const auto& p : policies) {
+            state.policy.set(p.first, p.second);
+        }
+    }
+
+private:
+    static vector<string> split(const string& s) {
+        vector<string> words;
+        size_t i = 0;
+        for (;;) {
+            i = s.find_first_not_of(" \t\r", i);
+            if (i == string::npos) {
+                return words;
+            }
+            size_t end = std::min(s.find_first_of(" \t\r", i), s.size());
+            words.push_back(s.substr(i, end - i));
+            i = end;
+        }
+    }
+
+    static bool parse_number(const string& s, unsigned& n) {
+        char *end;
+        unsigned long v = strtoul(s.c_str(), &end, 10);
+        if (s.empty() || *end || v > UINT_MAX) {
+            return false;
+        }
+        n = v;
+        return true;
+    }
+
+    bool parse_setting(const vector<string>& words) {
+        const string& key = words[0];
+        if (key == "policy" && words.size() == 3) {
+            IndexPolicy policy;
+            if (!parse_index_policy(words[2].c_str(), policy)) {
+                return false;
+            }
+            policies.push_back(std::make_pair(words[1], policy));
+            return true;
+        }
+        if (words.size() != 2) {
+            return false;
+        }
+        const string& value = words[1];
+        if (key == "table_size") {
+            return parse_number(value, table_size);
+        } else if (key == "max_entry_percent") {
+            return parse_number(value, max_entry_percent);
+        } else if (key == "default_policy") {
+            return parse_index_policy(value.c_str(), default_policy);
+        } else if (key == "volatility" && (value == "on" || value == "off")) {
+            volatility = value == "on";
+            return true;
+        }
+        return false;
+    }
+};
+
+inline bool read_encoder_config(const char *path, EncoderConfig& config, size_t& line)
+{
+    string contents;
+    line = 0;
+    return read_file(path, contents) && config.parse(contents, line);
+}
+
+} // namespace
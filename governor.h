@@ -0,0 +1,171 @@
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+// Keeps track of the memory used by the dynamic tables of all encoders and
+// decoders in the process. When the total goes over the budget, encoders are
+// told to shrink their tables (with a size update at the start of their next
+// block), starting with the ones that have been idle the longest. When usage
+// drops well below the budget, the limits are gradually lifted again.
+//
+// Decoder tables are counted, but can't be shrunk from this end: that would
+// take a new SETTINGS_HEADER_TABLE_SIZE, which is up to the HTTP/2 layer.
+//
+// Encoders and decoders only report their usage at the end of each header
+// block, and only take the lock when over (or well under) the budget.
+class TableMemoryGovernor {
+public:
+    struct Account {
+        std::atomic<size_t> used;
+        // steady_clock ticks of the last report, for finding cold tables
+        std::atomic<int64_t> last_active;
+        // Table size limit for an encoder, UINT_MAX for none
+        std::atomic<unsigned> limit;
+        const bool shrinkable;
+
+        Account(bool shrinkable): used(0), last_active(0), limit(UINT_MAX), shrinkable(shrinkable) {}
+    };
+    typedef std::shared_ptr<Account> AccountPtr;
+
+    // Tables are never limited to less than this, so a shrunk connection
+    // still gets some compression.
+    static const unsigned MIN_TABLE_SIZE = 256;
+
+    TableMemoryGovernor(): total(0), budget(0), limited(0) {}
+
+    static TableMemoryGovernor& get() {
+        static TableMemoryGovernor governor;
+        return governor;
+    }
+
+    // 0 means unlimited
+    void set_budget(size_t bytes) {
+        budget.store(bytes, std::memory_order_relaxed);
+        rebalance();
+    }
+
+    size_t get_total() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    // The account is closed when the last copy of the pointer goes away.
+    AccountPtr open(bool shrinkable) {
+        Account *account = new Account(shrinkable);
+        std::lock_guard<std::mutex> guard(lock);
+        accounts.insert(account);
+        return AccountPtr(account, [this](Account *account) {
+            close(account);
+        });
+    }
+
+    void report(Account& account, size_t used) {
+        account.last_active.store(now(), std::memory_order_relaxed);
+        size_t old = account.used.exchange(used, std::memory_order_relaxed);
+        if (old == used) {
+            return;
+        }
+        size_t new_total = total.fetch_add(used - old, std::memory_order_relaxed) + (used - old);
+        size_t b = budget.load(std::memory_order_relaxed);
+        if (b && (new_total > b || (new_total < b / 2 && limited.load(std::memory_order_relaxed)))) {
+            rebalance();
+        }
+    }
+
+private:
+    std::mutex lock;
+    set<Account*> accounts;
+    std::atomic<size_t> total;
+    std::atomic<size_t> budget;
+    // Number of accounts with a limit
+    std::atomic<size_t> limited;
+
+    static int64_t now() {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    void close(Account *account) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            accounts.erase(account);
+            if (account->limit.load(std::memory_order_relaxed) != UINT_MAX) {
+                limited--;
+            }
+        }
+        total.fetch_sub(account->used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        delete account;
+    }
+
+    static size_t expected_use(const Account& a) {
+        return std::min<size_t>(a.used.load(std::memory_order_relaxed), a.limit.load(std::memory_order_relaxed));
+    }
+
+    void set_limit(Account& a, unsigned limit) {
+        unsigned old = a.limit.exchange(limit, std::memory_order_relaxed);
+        if (old == UINT_MAX && limit != UINT_MAX) {
+            limited++;
+        } else if (old != UINT_MAX && limit == UINT_MAX) {
+            limited--;
+        }
+    }
+
+    void rebalance() {
+        std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+        if (!guard.owns_lock()) {
+            // Someone else is already on it
+            return;
+        }
+        const size_t b = budget.load(std::memory_order_relaxed);
+
+        vector<Account*> shrinkable;
+        size_t expected = 0;
+        for (Account *a : accounts) {
+            expected += expected_use(*a);
+            if (a->shrinkable) {
+                shrinkable.push_back(a);
+            }
+        }
+        std::sort(shrinkable.begin(), shrinkable.end(), [](const Account *a, const Account *b) {
+            return a->last_active.load(std::memory_order_relaxed) < b->last_active.load(std::memory_order_relaxed);
+        });
+
+        if (b && expected > b) {
+            // Halve the coldest tables until the tables (once they have
+            // shrunk) fit in the budget.
+            for (Account *a : shrinkable) {
+                if (expected <= b) {
+                    break;
+                }
+                size_t use = expected_use(*a);
+                unsigned limit = std::max<size_t>(MIN_TABLE_SIZE, use / 2);
+                if (limit < use) {
+                    debug("governor: limiting table to %u (using %zu)\n", limit, use);
+                    set_limit(*a, limit);
+                    expected -= use - limit;
+                }
+            }
+        } else if (!b || expected < b / 2) {
+            // Let the hottest tables grow again.
+            for (auto p = shrinkable.rbegin(); p != shrinkable.rend(); p++) {
+                Account& a = **p;
+                unsigned limit = a.limit.load(std::memory_order_relaxed);
+                if (limit == UINT_MAX) {
+                    continue;
+                }
+                unsigned new_limit = b && limit < 65536 ? limit * 2 : UINT_MAX;
+                debug("governor: raising table limit from %u to %u\n", limit, new_limit);
+                size_t use = expected_use(a);
+                set_limit(a, new_limit);
+                expected += expected_use(a) - use;
+                if (b && expected >= b / 2) {
+                    break;
+                }
+            }
+        }
+    }
+};
+
+} // namespace
@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "http1.h"
+
+// Reads raw HTTP/1.1 message heads (requests or responses, without bodies)
+// and writes them as HPACK header blocks, like hpack.
+int main(int argc, const char *argv[])
+{
+    PackState state;
+    Http1Parser parser;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "cs:S:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            state.crumble_cookies = true;
+            break;
+        case 's':
+            parser.scheme = optarg;
+            break;
+        case 'S':
+            state.set_settings_table_size(atoi(optarg));
+            break;
+        case 't':
+            state.set_table_size(atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-s scheme] [-S settings_size] [-t table_size]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    const string input = read_fully(stdin);
+    const char *pos = input.c_str();
+    const char *const end = pos + input.size();
+    while (pos < end) {
+        size_t used;
+        Http1Result result = parser.parse(pos, end, used, [&state](HeaderToken token, const string& name, const string& value) {
+            state.pack(token, name, value);
+        });
+        if (result != HTTP1_OK) {
+            fprintf(stderr, "%s: %s message head at offset %zu\n", argv[0],
+                    result == HTTP1_INCOMPLETE ? "incomplete" : "invalid", pos - input.c_str());
+            return 1;
+        }
+        state.end_block();
+        pos += used;
+    }
+    const string& output = state.get_output();
+    fwrite(output.c_str(), 1, output.length(), stdout);
+}
@@ -4,6 +4,10 @@
 #include <string.h>
 
 #include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
 #include "unpack.h"
 
 namespace {
@@ -67,7 +71,7 @@ struct Http2State
 #if save_stream_headers
         Headers& headers = stream_headers[stream];
 #endif
-        state.unpack([&](const string& name, const string& value) {
+        UnpackError error = state.unpack([&](const string& name, const string& value) {
 #if check_pseudoheaders
             if (name[0] == ':') {
                 if (regular_headers_seen.count(stream)) {
@@ -82,6 +86,10 @@ struct Http2State
 #endif
             fprintf(stderr, "%u: %s: %s\n", stream, name.c_str(), value.c_str());
         });
+        if (error) {
+            fprintf(stderr, "Error: %s in headers for stream %u\n",
+                    unpack_error_string(error), stream);
+        }
     }
 
     void read_frame(string& input) {
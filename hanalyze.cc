@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "unpack.h"
+#include "trace.h"
+
+// Table sizes simulated, from 256 bytes to 64 KB
+static const unsigned MIN_TABLE_SIZE = 256;
+static const unsigned MAX_TABLE_SIZE = 65536;
+
+struct NameStats {
+    size_t fields;
+    size_t header_bytes;
+    size_t encoded_bytes;
+};
+
+// Reuse distances in power-of-two buckets of table bytes (32 plus name and
+// value for each field in between, as counted for the table size), from
+// < MIN_TABLE_SIZE to >= MAX_TABLE_SIZE, and first uses.
+class ReuseHistogram {
+    map<string, uint64_t> last_seen;
+
+public:
+    vector<size_t> buckets;
+    size_t first_uses;
+
+    ReuseHistogram(): buckets(1), first_uses(0) {
+        for (unsigned size = MIN_TABLE_SIZE; size <= MAX_TABLE_SIZE; size *= 2) {
+            buckets.push_back(0);
+        }
+    }
+
+    void add(const string& key, uint64_t position) {
+        auto p = last_seen.insert(std::make_pair(key, position));
+        if (p.second) {
+            first_uses++;
+            return;
+        }
+        uint64_t distance = position - p.first->second;
+        p.first->second = position;
+        size_t b = 0;
+        for (uint64_t size = MIN_TABLE_SIZE; b + 1 < buckets.size() && distance >= size; size *= 2) {
+            b++;
+        }
+        buckets[b]++;
+    }
+
+    size_t total() const {
+        size_t n = first_uses;
+        for (size_t b : buckets) {
+            n += b;
+        }
+        return n;
+    }
+};
+
+static bool read_trace(const char *path, vector<HeaderList>& blocks)
+{
+    TraceReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "Can't read trace %s\n", path);
+        return false;
+    }
+    while (!reader.eof()) {
+        blocks.push_back(HeaderList());
+        if (UnpackError error = reader.read_block(blocks.back())) {
+            fprintf(stderr, "%s: %s\n", path, unpack_error_string(error));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encodes the blocks with every table size from MIN_TABLE_SIZE to
+// MAX_TABLE_SIZE, in parallel, and returns the encoded size for each. The
+// fields must have been checked already.
+static vector<size_t> simulate_table_sizes(const PackState& proto, const vector<HeaderList>& blocks)
+{
+    vector<unsigned> sizes;
+    for (unsigned size = MIN_TABLE_SIZE; size <= MAX_TABLE_SIZE; size *= 2) {
+        sizes.push_back(size);
+    }
+    vector<size_t> encoded(sizes.size());
+    parallel_for(sizes.size(), [&](size_t s) {
+        PackState state = proto.fork();
+        state.set_settings_table_size(sizes[s]);
+        state.set_table_size(sizes[s]);
+        for (const HeaderList& headers : blocks) {
+            state.pack_block(headers);
+            encoded[s] += state.get_output().size();
+            state.clear_output();
+        }
+    });
+    return encoded;
+}
+
+static void print_reuse(const ReuseHistogram& names, const ReuseHistogram& fields)
+{
+    const size_t total = names.total();
+    printf("\n%-18s %8s %8s\n", "reuse distance", "names", "fields");
+    unsigned size = MIN_TABLE_SIZE;
+    for (size_t b = 0; b < names.buckets.size(); b++, size *= 2) {
+        char label[32];
+        if (b + 1 < names.buckets.size()) {
+            snprintf(label, sizeof(label), "< %u", size);
+        } else {
+            snprintf(label, sizeof(label), ">= %u", size / 2);
+        }
+        printf("%-18s %7.1f%% %7.1f%%\n", label,
+                100.0 * names.buckets[b] / total, 100.0 * fields.buckets[b] / total);
+    }
+    printf("%-18s %7.1f%% %7.1f%%\n", "first use",
+            100.0 * names.first_uses / total, 100.0 * fields.first_uses / total);
+}
+
+// Replays header blocks (hpack's input format on stdin, or a trace with -r)
+// through the encoder, and reports the encoded size for each table size,
+// each header name's share of the output and the reuse distances of names
+// and fields.
+int main(int argc, const char *argv[])
+{
+    PackState state;
+    const char *trace = nullptr;
+    unsigned table_size = 4096;
+    size_t top = 20;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "cLr:t:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            state.crumble_cookies = true;
+            break;
+        case 'L':
+            state.volatility.enabled = false;
+            break;
+        case 'r':
+            trace = optarg;
+            break;
+        case 't':
+            table_size = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-L] [-r trace] [-t table_size] [-n names] [< headers]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    vector<HeaderList> blocks;
+    if (trace) {
+        if (!read_trace(trace, blocks)) {
+            return 1;
+        }
+    } else {
+        blocks = parse_header_blocks(read_fully(stdin));
+    }
+    if (blocks.empty()) {
+        fprintf(stderr, "%s: no header blocks\n", argv[0]);
+        return 1;
+    }
+
+    // Per name, with the table size from -t: the output of each field is
+    // what it added to the encoder's output.
+    map<string, NameStats> names;
+    ReuseHistogram name_reuse, field_reuse;
+    size_t header_bytes = 0;
+    uint64_t position = 0;
+    PackState encoder = state.fork();
+    encoder.set_settings_table_size(table_size);
+    encoder.set_table_size(table_size);
+    string key, lowercase;
+    for (const HeaderList& headers : blocks) {
+        for (const Header& h : headers) {
+            // Keyed by the name as encoded, i.e. lowercased
+            const string *n = normalize_field(h.first, h.second, lowercase);
+            if (!n) {
+                fprintf(stderr, "%s: invalid header field %s\n", argv[0], h.first.c_str());
+                return 1;
+            }
+            size_t before = encoder.get_output().size();
+            encoder.pack(HeaderTokens::get().find(*n), *n, h.second);
+            NameStats& stats = names[*n];
+            stats.fields++;
+            stats.header_bytes += h.first.size() + h.second.size();
+            stats.encoded_bytes += encoder.get_output().size() - before;
+            header_bytes += h.first.size() + h.second.size();
+
+            encoder.for_each_field(*n, h.second, [&](const string& name, const string& value) {
+                key.assign(name);
+                key += '\0';
+                key += value;
+                name_reuse.add(name, position);
+                field_reuse.add(key, position);
+                position += 32 + name.size() + value.size();
+            });
+        }
+        encoder.end_block();
+    }
+    const size_t encoded_bytes = encoder.get_output().size();
+
+    printf("%zu blocks, %zu header bytes\n\n", blocks.size(), header_bytes);
+    printf("%-10s %12s %7s\n", "table size", "encoded", "ratio");
+    unsigned size = MIN_TABLE_SIZE;
+    for (size_t encoded : simulate_table_sizes(state, blocks)) {
+        printf("%-10u %12zu %6.1f%%\n", size, encoded, 100.0 * encoded / header_bytes);
+        size *= 2;
+    }
+
+    vector<std::pair<string, NameStats>> by_output(names.begin(), names.end());
+    std::sort(by_output.begin(), by_output.end(), [](const std::pair<string, NameStats>& a, const std::pair<string, NameStats>& b) {
+        return a.second.encoded_bytes > b.second.encoded_bytes;
+    });
+    printf("\nbytes by name, table size %u (%zu encoded bytes)\n", table_size, encoded_bytes);
+    printf("%-32s %8s %12s %12s %7s\n", "name", "fields", "header", "encoded", "share");
+    for (size_t i = 0; i < by_output.size() && i < top; i++) {
+        const NameStats& stats = by_output[i].second;
+        printf("%-32s %8zu %12zu %12zu %6.1f%%\n", by_output[i].first.c_str(), stats.fields,
+                stats.header_bytes, stats.encoded_bytes, 100.0 * stats.encoded_bytes / encoded_bytes);
+    }
+
+    print_reuse(name_reuse, field_reuse);
+}
@@ -0,0 +1,84 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "unpack.h"
+#include "archive.h"
+
+// Writes header blocks (in hpack's input format) from stdin to an archive on
+// stdout, or with -x, extracts blocks from an archive.
+int main(int argc, const char *argv[])
+{
+    PackState state;
+    unsigned table_size = 4096;
+    unsigned interval = 1024;
+    const char *extract = nullptr;
+    uint64_t first = 0;
+    uint64_t count = UINT64_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "t:k:x:f:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            table_size = atoi(optarg);
+            break;
+        case 'k':
+            interval = atoi(optarg);
+            break;
+        case 'x':
+            extract = optarg;
+            break;
+        case 'f':
+            first = strtoull(optarg, nullptr, 10);
+            break;
+        case 'n':
+            count = strtoull(optarg, nullptr, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t table_size] [-k checkpoint_interval] < headers > archive\n"
+                    "       %s -x archive [-f first_block] [-n blocks]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (extract) {
+        ArchiveReader reader;
+        if (!reader.open(extract)) {
+            fprintf(stderr, "%s: can't read archive %s\n", argv[0], extract);
+            return 1;
+        }
+        debug("%zu blocks, %zu checkpoints\n", (size_t)reader.block_count(), reader.checkpoint_count());
+        string out;
+        if (UnpackError error = reader.extract(first, count, out)) {
+            fprintf(stderr, "%s: %s\n", argv[0], unpack_error_string(error));
+            return 1;
+        }
+        fwrite(out.c_str(), 1, out.length(), stdout);
+        return 0;
+    }
+
+    if (!interval) {
+        fprintf(stderr, "%s: the checkpoint interval must be at least 1\n", argv[0]);
+        return 1;
+    }
+    state.set_settings_table_size(table_size);
+    state.set_table_size(table_size);
+    ArchiveWriter writer(state, table_size, interval);
+    for (const HeaderList& headers : parse_header_blocks(read_fully(stdin))) {
+        if (!writer.add(headers)) {
+            fprintf(stderr, "%s: invalid header field\n", argv[0]);
+            return 1;
+        }
+    }
+    const string& output = writer.finish();
+    fwrite(output.c_str(), 1, output.length(), stdout);
+}
@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "unpack.h"
+#include "trace.h"
+
+struct Options {
+    unsigned blocks;
+    // Custom headers per block, and the number of distinct values of each
+    unsigned custom_headers;
+    unsigned cardinality;
+    // Chance of a value never seen before, in percent
+    unsigned churn;
+    unsigned value_length;
+    // Size of the cookie header (0 for none)
+    unsigned cookie_size;
+    // Chance of a byte that has a 19 to 30 bit Huffman code, in percent
+    unsigned exotic;
+};
+
+class Generator {
+    const Options& options;
+    Random random;
+    // Pools of values, by header
+    map<string, vector<string>> pools;
+
+    char value_byte() {
+        if (options.exotic && random.percent(options.exotic)) {
+            // Control characters (minus NUL, CR and LF, which HTTP/2 doesn't
+            // allow) have 28 to 30 bit codes, bytes >= 0x80 19 to 27 bits.
+            for (;;) {
+                uint8_t c = random.next() % 160;
+                c = c < 32 ? c : c - 32 + 0x80;
+                if (c && c != '\r' && c != '\n') {
+                    return c;
+                }
+            }
+        }
+        static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-_";
+        return chars[random.next() % (sizeof(chars) - 1)];
+    }
+
+    string random_value(size_t length) {
+        string s;
+        for (size_t i = 0; i < length; i++) {
+            s += value_byte();
+        }
+        return s;
+    }
+
+    // A value from the pool for name, or with churn percent chance a new
+    // one.
+    string value(const string& name, size_t length) {
+        if (random.percent(options.churn)) {
+            return random_value(length);
+        }
+        vector<string>& pool = pools[name];
+        size_t i = random.next() % std::max(1u, options.cardinality);
+        while (pool.size() <= i) {
+            pool.push_back(random_value(length));
+        }
+        return pool[i];
+    }
+
+public:
+    Generator(const Options& options, uint64_t seed): options(options), random(seed) {}
+
+    void block(HeaderList& headers) {
+        static const char *const hosts[] = { "www.example.com", "api.example.com", "static.example.net", "example.org" };
+        headers.clear();
+        headers.push_back(Header(":method", random.percent(90) ? "GET" : "POST"));
+        headers.push_back(Header(":scheme", "https"));
+        headers.push_back(Header(":authority", hosts[random.next() % 4]));
+        headers.push_back(Header(":path", "/" + value(":path", options.value_length)));
+        headers.push_back(Header("user-agent", value("user-agent", 2 * options.value_length)));
+        headers.push_back(Header("accept", "*/*"));
+        headers.push_back(Header("accept-encoding", "gzip, deflate, br"));
+        for (unsigned i = 0; i < options.custom_headers; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "x-custom-%u", i);
+            headers.push_back(Header(name, value(name, options.value_length)));
+        }
+        if (options.cookie_size) {
+            // Crumbs of about value_length bytes
+            string cookie;
+            for (unsigned i = 0; cookie.size() < options.cookie_size; i++) {
+                if (i) {
+                    cookie += "; ";
+                }
+                char name[32];
+                snprintf(name, sizeof(name), "c%u=", i);
+                cookie += name;
+                cookie += value(name, options.value_length);
+            }
+            cookie.resize(options.cookie_size);
+            headers.push_back(Header("cookie", cookie));
+        }
+    }
+};
+
+// Writes a synthetic workload in hpack's input format, or with -T as a trace
+// for htrace -r.
+int main(int argc, const char *argv[])
+{
+    Options options = { 1000, 4, 16, 10, 16, 0, 0 };
+    uint64_t seed = 1;
+    bool trace = false;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "s:b:H:v:u:l:C:x:T")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'b':
+            options.blocks = atoi(optarg);
+            break;
+        case 'H':
+            options.custom_headers = atoi(optarg);
+            break;
+        case 'v':
+            options.cardinality = atoi(optarg);
+            break;
+        case 'u':
+            options.churn = atoi(optarg);
+            break;
+        case 'l':
+            options.value_length = atoi(optarg);
+            break;
+        case 'C':
+            options.cookie_size = atoi(optarg);
+            break;
+        case 'x':
+            options.exotic = atoi(optarg);
+            break;
+        case 'T':
+            trace = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s seed] [-b blocks] [-H custom_headers] [-v distinct_values] [-u churn_percent] [-l value_length] [-C cookie_size] [-x exotic_byte_percent] [-T]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Generator generator(options, seed);
+    TraceWriter writer;
+    HeaderList headers;
+    string text;
+    for (unsigned i = 0; i < options.blocks; i++) {
+        generator.block(headers);
+        if (trace) {
+            writer.add(headers);
+            continue;
+        }
+        text.clear();
+        for (const Header& h : headers) {
+            text += h.first;
+            text += ": ";
+            text += h.second;
+            text += '\n';
+        }
+        text += '\n';
+        fwrite(text.c_str(), 1, text.length(), stdout);
+    }
+    if (trace) {
+        const string& output = writer.get_output();
+        fwrite(output.c_str(), 1, output.length(), stdout);
+    }
+}
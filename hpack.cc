@@ -1,153 +1,144 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "config.h"
+#include "offline.h"
+#include "batch.h"
 
-namespace {
-const bool USE_HUFFMAN = true;
-
-void put8(uint8_t v)
-{
-    fwrite(&v, 1, 1, stdout);
-}
-
-void put_vint(unsigned value)
-{
-    while (value >= 0x80) {
-        put8(0x80 | (value & 0x7f));
-        value >>= 7;
-    }
-    put8(value);
-}
-
-void put_int(uint8_t prebyte, unsigned prebits, unsigned value)
-{
-    const unsigned maxval = (1 << prebits) - 1;
-    if (value < maxval) {
-        put8(prebyte | value);
-    } else {
-        put8(prebyte | maxval);
-        put_vint(value - maxval);
-    }
-}
-
-unsigned drain(string& out, unsigned& bits, unsigned len)
-{
-    while (len >= 8) {
-        len -= 8;
-        out += (char)(uint8_t)(bits >> len);
-        bits &= (1 << len) - 1;
-    }
-    return len;
-}
-
-string huff(const string &h)
+int main(int argc, const char *argv[])
 {
-    unsigned bits = 0;
-    unsigned n = 0;
+    PackState state;
+    bool offline = false;
+    bool batch = false;
 
-    string out;
-    const char *p = h.c_str();
-    while (uint8_t c = *p++) {
-        uint32_t code = huff_codes[c];
-        unsigned len = huff_lengths[c];
-        if (len > 24) {
-            bits <<= len - 24;
-            bits |= (code >> (len - 25));
-            n += len - 24;
-            len = 24;
-            n = drain(out, bits, n);
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "BcC:LOp:s:S:t:d:M:Em")) != -1) {
+        switch (opt) {
+        case 'B':
+            batch = true;
+            break;
+        case 'E':
+            // Dump the trace to stderr at exit
+            Tracepoints::enable(true);
+            atexit([]() {
+                Tracepoints::get().dump(stderr);
+            });
+            break;
+        case 'm':
+            // Print the codec metrics to stderr at exit
+            state.use_metrics(CodecMetrics::get());
+            atexit([]() {
+                CodecMetrics::print(stderr, "encoder", CodecMetrics::get().snapshot().encoder);
+            });
+            break;
+        case 'c':
+            state.crumble_cookies = true;
+            break;
+        case 'C':
+            {
+                // Settings from htune
+                EncoderConfig config;
+                size_t line;
+                if (!read_encoder_config(optarg, config, line)) {
+                    if (line) {
+                        fprintf(stderr, "Invalid encoder config %s, line %zu\n", optarg, line);
+                    } else {
+                        fprintf(stderr, "Can't read encoder config %s\n", optarg);
+                    }
+                    return 1;
+                }
+                config.apply(state);
+                break;
+            }
+        case 'O':
+            offline = true;
+            break;
+        case 'L':
+            state.volatility.enabled = false;
+            break;
+        case 's':
+            state.policy.short_cookie_length = atoi(optarg);
+            break;
+        case 'S':
+            state.set_settings_table_size(atoi(optarg));
+            break;
+        case 't':
+            state.set_table_size(atoi(optarg));
+            break;
+        case 'M':
+            TableMemoryGovernor::get().set_budget(atoi(optarg));
+            state.use_memory_governor(TableMemoryGovernor::get());
+            break;
+        case 'p':
+            {
+                // -p name=index|name|literal|never
+                const char *eq = strchr(optarg, '=');
+                IndexPolicy policy;
+                if (!eq || !parse_index_policy(eq + 1, policy)) {
+                    fprintf(stderr, "Invalid policy: %s\n", optarg);
+                    return 1;
+                }
+                state.policy.set(string((const char *)optarg, eq), policy);
+                break;
+            }
+        case 'd':
+            {
+                HeaderList profile;
+                if (!read_table_profile(optarg, profile)) {
+                    fprintf(stderr, "Can't read table profile %s\n", optarg);
+                    return 1;
+                }
+                state.load_profile(profile);
+                break;
+            }
+        default:
+            fprintf(stderr, "Usage: %s [-B] [-c] [-C config] [-E] [-d profile] [-L] [-m] [-O] [-s short_cookie_length] [-S settings_size] [-t table_size] [-M memory_budget] [-p name=index|name|literal|never]...\n", argv[0]);
+            return 1;
         }
-        bits <<= len;
-        bits |= code;
-        n = drain(out, bits, n + len);
     }
-    if (n) {
-        bits <<= 7;
-        bits |= 0x7f;
-        n = drain(out, bits, n + 7);
-    }
-    return out;
-}
 
-void put_string(const string &s)
-{
-    if (USE_HUFFMAN) {
-        string h = huff(s);
-        if (h.size() < s.size()) {
-            put_int(0x80, 7, h.size());
-            fwrite(h.c_str(), 1, h.length(), stdout);
-            return;
+    if (batch && offline) {
+        fprintf(stderr, "%s: -B and -O can't be combined\n", argv[0]);
+        return 1;
+    }
+    if (batch) {
+        string output;
+        if (!BatchPacker(state, parse_connection_blocks(read_fully(stdin))).pack(output)) {
+            fprintf(stderr, "%s: invalid header field\n", argv[0]);
+            return 1;
         }
+        fwrite(output.c_str(), 1, output.length(), stdout);
+        return 0;
     }
-    put_int(0, 7, s.size());
-    fwrite(s.c_str(), 1, s.length(), stdout);
-}
-}
 
-int main(int argc, const char *argv[])
-{
-    const unsigned max_dynamic_size = 4096;
-    DynamicTable dyn_table;
-
-    string input = read_fully(stdin);
-    const char *pos = input.c_str();
-    const char *input_end = pos + input.length();
-    while (*pos) {
-        const char *start = pos;
-        const char *end = strchr(start, '\n');
-        pos = end ? end + 1 : input_end;
-        const char *name_end = strchr(start + 1, ':');
-        const char *value_start = name_end + 1;
-        value_start += strspn(value_start, " ");
-
-        string name = string(start, name_end);
-        string value = string(value_start, end ? end : input_end);
+    vector<HeaderList> blocks = parse_header_blocks(read_fully(stdin));
 
-        debug("\nparsed %s = %s\n", name.c_str(), value.c_str());
-
-        bool push = true;
-        size_t table_size = 32 + name.length() + value.length();
-        // TODO Add a rule (like similar code in other encoders) for deciding
-        // if a header value is sensitive and should be forced literal.
-        uint8_t sensitive = 0; // 0x10;
-        if (sensitive || table_size > 3 * max_dynamic_size / 4) {
-            // Sensitive => "literal header never indexed", intermediaries must
-            // not use indexed encoding for this.
-            // not sensitive => "literal header without indexing", just avoid
-            // blowing away the dynamic table.
-            debug("oversized/sensitive (%zu), non-indexed\n", table_size);
-            int name_ix = dyn_table.find(name);
-            if (name_ix) {
-                put_int(sensitive, 4, name_ix);
-            } else {
-                put8(sensitive);
-                put_string(name);
-            }
-            put_string(value);
-            push = false;
-        } else if (int i = dyn_table.find(name, value)) {
-            debug("index (both): %d\n", i);
-            push = false; // References are never added to the table.
-            put_int(0x80, 7, i);
-        } else if (int i = dyn_table.find(name)) {
-            debug("index (name): %d\n", i);
-            // put value as literal, may want to decide on indexed or not.
-            put_int(0x40, 6, i);
-            put_string(value);
-        } else {
-            debug("literal\n");
-            // always indexed, but may want to decide :)
-            put8(0x40);
-            put_string(name);
-            put_string(value);
+    string output;
+    if (offline) {
+        OfflinePacker packer(state, blocks);
+        if (!packer.valid) {
+            fprintf(stderr, "%s: invalid header field\n", argv[0]);
+            return 1;
         }
-        if (push) {
-            dyn_table.push(name, value);
-            dyn_table.shrink(max_dynamic_size);
-            debug("adding to dyn table: %s = %s (size = %u)\n", name.c_str(), value.c_str(), dyn_table.size);
+        output = packer.pack();
+    } else {
+        for (const HeaderList& headers : blocks) {
+            if (!state.pack_block(headers)) {
+                fprintf(stderr, "%s: invalid header field\n", argv[0]);
+                return 1;
+            }
         }
+        output = state.get_output();
     }
+    fwrite(output.c_str(), 1, output.length(), stdout);
 }
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "unpack.h"
+#include "trace.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t nanoseconds(Clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+static void print_latencies(const char *what, vector<uint64_t>& ns)
+{
+    std::sort(ns.begin(), ns.end());
+    auto percentile = [&ns](double p) {
+        return ns[std::min<size_t>(ns.size() - 1, ns.size() * p)] / 1000.0;
+    };
+    printf("%s latency (us): p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+            what, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), ns.back() / 1000.0);
+}
+
+// Replays the trace through an encoder and a decoder iterations times, and
+// reports throughput and per-block latencies.
+static int replay(const char *path, unsigned iterations, bool cookies)
+{
+    TraceReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "Can't read trace %s\n", path);
+        return 1;
+    }
+    vector<HeaderList> blocks;
+    size_t header_bytes = 0;
+    while (!reader.eof()) {
+        blocks.push_back(HeaderList());
+        if (UnpackError error = reader.read_block(blocks.back())) {
+            fprintf(stderr, "%s: %s\n", path, unpack_error_string(error));
+            return 1;
+        }
+        for (const Header& h : blocks.back()) {
+            header_bytes += h.first.size() + h.second.size();
+        }
+    }
+    if (blocks.empty()) {
+        fprintf(stderr, "%s: empty trace\n", path);
+        return 1;
+    }
+
+    vector<uint64_t> encode_ns, decode_ns;
+    encode_ns.reserve(blocks.size() * iterations);
+    decode_ns.reserve(blocks.size() * iterations);
+    size_t encoded_bytes = 0;
+    for (unsigned i = 0; i < iterations; i++) {
+        // A new connection per iteration
+        PackState pack;
+        UnpackState unpack;
+        pack.crumble_cookies = unpack.combine_cookies = cookies;
+        encoded_bytes = 0;
+        for (const HeaderList& headers : blocks) {
+            Clock::time_point start = Clock::now();
+            pack.clear_output();
+            if (!pack.pack_block(headers)) {
+                fprintf(stderr, "%s: invalid header field\n", path);
+                return 1;
+            }
+            Clock::time_point encoded = Clock::now();
+            unpack.feed(pack.get_output());
+            size_t fields = 0;
+            UnpackError error = unpack.unpack([&fields](const string&, const string&) {
+                fields++;
+            });
+            Clock::time_point decoded = Clock::now();
+            if (error) {
+                fprintf(stderr, "%s: %s\n", path, unpack_error_string(error));
+                return 1;
+            }
+            encode_ns.push_back(nanoseconds(encoded - start));
+            decode_ns.push_back(nanoseconds(decoded - encoded));
+            encoded_bytes += pack.get_output().size();
+        }
+    }
+
+    uint64_t encode_total = 0, decode_total = 0;
+    for (size_t i = 0; i < encode_ns.size(); i++) {
+        encode_total += encode_ns[i];
+        decode_total += decode_ns[i];
+    }
+    const double mb = (double)header_bytes * iterations / 1e6;
+    printf("%zu blocks, %zu header bytes, %zu encoded bytes (%.1f%%)\n",
+            blocks.size(), header_bytes, encoded_bytes, 100.0 * encoded_bytes / header_bytes);
+    printf("encode: %.1f MB/s, %.0f blocks/s\n", mb / (encode_total / 1e9), encode_ns.size() / (encode_total / 1e9));
+    printf("decode: %.1f MB/s, %.0f blocks/s\n", mb / (decode_total / 1e9), decode_ns.size() / (decode_total / 1e9));
+    print_latencies("encode", encode_ns);
+    print_latencies("decode", decode_ns);
+    return 0;
+}
+
+// Records header blocks (in hpack's input format) from stdin as a trace on
+// stdout, or with -r, replays a trace.
+int main(int argc, const char *argv[])
+{
+    bool anonymize = false;
+    uint64_t seed = 1;
+    const char *replay_path = nullptr;
+    unsigned iterations = 10;
+    bool cookies = false;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "as:r:n:c")) != -1) {
+        switch (opt) {
+        case 'a':
+            anonymize = true;
+            break;
+        case 's':
+            seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'r':
+            replay_path = optarg;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'c':
+            cookies = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a] [-s seed] < headers > trace\n"
+                    "       %s -r trace [-n iterations] [-c]\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (replay_path) {
+        return replay(replay_path, std::max(1u, iterations), cookies);
+    }
+
+    TraceWriter writer;
+    TraceAnonymizer anonymizer(seed);
+    for (HeaderList& headers : parse_header_blocks(read_fully(stdin))) {
+        if (anonymize) {
+            for (Header& h : headers) {
+                h.second = anonymizer.anonymize(h.first, h.second);
+            }
+        }
+        writer.add(headers);
+    }
+    const string& output = writer.get_output();
+    fwrite(output.c_str(), 1, output.length(), stdout);
+}
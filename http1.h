@@ -0,0 +1,271 @@
+#include <strings.h>
+
+namespace {
+
+enum Http1Result {
+    HTTP1_OK,
+    // The head doesn't end (with an empty line) in the input.
+    HTTP1_INCOMPLETE,
+    HTTP1_INVALID,
+};
+
+// Turns raw HTTP/1.1 message heads into HTTP/2 header fields: the request
+// line becomes :method, :scheme, :authority (from the target or the host
+// header) and :path, the status line :status. Names are lowercased, and
+// connection-specific headers (RFC 7540 section 8.1.2.2) are dropped.
+//
+// The head is split into lines in one pass (memchr), remembering where each
+// name and value is. Fields are then passed on from the input bytes, through
+// name and value buffers that are reused for every field.
+class Http1Parser {
+    struct Line {
+        const char *name;
+        size_t name_length;
+        const char *value;
+        size_t value_length;
+        // Set when checking the lines
+        HeaderToken token;
+        size_t lowercase_offset;
+    };
+
+    vector<Line> lines;
+    // The lowercased names of all lines, one after the other
+    string lowercase_names;
+    // Lowercased names listed in the connection header
+    vector<string> connection_names;
+    string name, value;
+    const HeaderToken host_token, te_token, connection_token;
+    // Never forwarded, whatever the connection header says
+    vector<HeaderToken> connection_specific;
+
+public:
+    // For requests, which don't say in HTTP/1.1 unless the target is an
+    // absolute URI.
+    string scheme;
+
+    Http1Parser(): host_token(HeaderTokens::get().find("host")),
+        te_token(HeaderTokens::get().find("te")),
+        connection_token(HeaderTokens::get().find("connection")), scheme("https") {
+        for (const char *name : { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" }) {
+            connection_specific.push_back(HeaderTokens::get().find(name));
+        }
+    }
+
+    // Parses the head at the start of [start, end), calling f(token, name,
+    // value) for each field, pseudo-headers first. On success, used is set
+    // to the length of the head including the empty line. A message body,
+    // if any, is not looked at.
+    template <typename T>
+    Http1Result parse(const char *start, const char *end, size_t& used, T&& f) {
+        const char *first_line = nullptr;
+        size_t first_length = 0;
+        Http1Result result = split_lines(start, end, first_line, first_length, used);
+        if (result != HTTP1_OK) {
+            return result;
+        }
+
+        // Everything is checked before the first field is passed on, so an
+        // invalid head doesn't leave a half-encoded block behind.
+        const Line *host = nullptr;
+        connection_names.clear();
+        lowercase_names.clear();
+        for (Line& l : lines) {
+            name.assign(l.name, l.name_length);
+            if (lowercase_field(name) & FIELD_FORBIDDEN || name.find_first_of(" \t") != string::npos) {
+                return HTTP1_INVALID;
+            }
+            value.assign(l.value, l.value_length);
+            if (check_field(value) & FIELD_FORBIDDEN) {
+                return HTTP1_INVALID;
+            }
+            l.token = HeaderTokens::get().find(name);
+            l.lowercase_offset = lowercase_names.size();
+            lowercase_names += name;
+            if (l.token == host_token) {
+                host = &l;
+            } else if (l.token == connection_token) {
+                add_connection_names(l.value, l.value + l.value_length);
+            }
+        }
+
+        if (first_length > 5 && !memcmp(first_line, "HTTP/", 5)) {
+            if (!status_line(first_line, first_length, f)) {
+                return HTTP1_INVALID;
+            }
+        } else if (!request_line(first_line, first_length, host, f)) {
+            return HTTP1_INVALID;
+        }
+
+        for (const Line& l : lines) {
+            name.assign(lowercase_names, l.lowercase_offset, l.name_length);
+            value.assign(l.value, l.value_length);
+            if (l.token == host_token || is_connection_specific(l.token, name)
+                    || (l.token == te_token && strcasecmp(value.c_str(), "trailers"))) {
+                debug("http1: dropping %s\n", name.c_str());
+                continue;
+            }
+            f(l.token, name, value);
+        }
+        return HTTP1_OK;
+    }
+
+private:
+    static const char *skip_space(const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        return p;
+    }
+
+    static const char *trim_space(const char *start, const char *end) {
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        return end;
+    }
+
+    // Fills lines with the header lines of the head, and returns the first
+    // line through first_line and first_length. Empty lines before it are
+    // skipped (RFC 7230 section 3.5), e.g. a CRLF left after a body.
+    Http1Result split_lines(const char *start, const char *end, const char *& first_line, size_t& first_length, size_t& used) {
+        lines.clear();
+        const char *p = start;
+        bool first = true;
+        while (p < end) {
+            const char *nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) {
+                return HTTP1_INCOMPLETE;
+            }
+            const char *line_end = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+            const char *line = p;
+            p = nl + 1;
+            if (first) {
+                if (line != line_end) {
+                    first = false;
+                    first_line = line;
+                    first_length = line_end - line;
+                }
+                continue;
+            }
+            if (line == line_end) {
+                used = p - start;
+                return HTTP1_OK;
+            }
+            const char *colon = (const char*)memchr(line, ':', line_end - line);
+            if (!colon || colon == line) {
+                return HTTP1_INVALID;
+            }
+            const char *value = skip_space(colon + 1, line_end);
+            lines.push_back({ line, size_t(colon - line), value, size_t(trim_space(value, line_end) - value), NO_TOKEN, 0 });
+        }
+        return HTTP1_INCOMPLETE;
+    }
+
+    void add_connection_names(const char *p, const char *end) {
+        while (p < end) {
+            const char *comma = (const char*)memchr(p, ',', end - p);
+            const char *item_end = comma ? comma : end;
+            const char *item = skip_space(p, item_end);
+            connection_names.push_back(string(item, trim_space(item, item_end)));
+            lowercase_field(connection_names.back());
+            p = item_end + 1;
+        }
+    }
+
+    bool is_connection_specific(HeaderToken token, const string& name) const {
+        if (std::find(connection_specific.begin(), connection_specific.end(), token) != connection_specific.end()) {
+            return true;
+        }
+        for (const string& n : connection_names) {
+            if (n == name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename T>
+    void pseudo(const char *name, const char *value, size_t length, T&& f, bool lowercase = false) {
+        this->name = name;
+        this->value.assign(value, length);
+        if (lowercase) {
+            lowercase_field(this->value);
+        }
+        f(HeaderTokens::get().find(this->name), this->name, this->value);
+    }
+
+    // HTTP/1.1 200 OK
+    template <typename T>
+    bool status_line(const char *line, size_t length, T&& f) {
+        const char *end = line + length;
+        const char *sp = (const char*)memchr(line, ' ', length);
+        if (!sp || end - sp < 4 || (end - sp > 4 && sp[4] != ' ')) {
+            return false;
+        }
+        for (int i = 1; i <= 3; i++) {
+            if (sp[i] < '0' || sp[i] > '9') {
+                return false;
+            }
+        }
+        pseudo(":status", sp + 1, 3, f);
+        return true;
+    }
+
+    // GET /path HTTP/1.1, with the target in origin form (/path), absolute
+    // form (http://host/path), authority form (CONNECT host:port) or *.
+    template <typename T>
+    bool request_line(const char *line, size_t length, const Line *host, T&& f) {
+        const char *end = line + length;
+        const char *sp1 = (const char*)memchr(line, ' ', length);
+        if (!sp1 || sp1 == line) {
+            return false;
+        }
+        const char *target = sp1 + 1;
+        const char *sp2 = (const char*)memchr(target, ' ', end - target);
+        if (!sp2 || sp2 == target || end - sp2 < 6 || memcmp(sp2 + 1, "HTTP/", 5)) {
+            return false;
+        }
+        const size_t method_length = sp1 - line;
+        pseudo(":method", line, method_length, f);
+
+        if (method_length == 7 && !memcmp(line, "CONNECT", 7)) {
+            pseudo(":authority", target, sp2 - target, f);
+            return true;
+        }
+
+        const char *authority = nullptr;
+        const char *authority_end = nullptr;
+        const char *path = target;
+        const char *scheme_end = (const char*)memchr(target, ':', sp2 - target);
+        if (*target != '/' && *target != '*' && scheme_end && sp2 - scheme_end > 3 && !memcmp(scheme_end, "://", 3)) {
+            // The scheme is case-insensitive (RFC 3986 section 3.1).
+            pseudo(":scheme", target, scheme_end - target, f, true);
+            authority = scheme_end + 3;
+            authority_end = authority;
+            while (authority_end < sp2 && *authority_end != '/' && *authority_end != '?') {
+                authority_end++;
+            }
+            path = authority_end;
+        } else {
+            pseudo(":scheme", scheme.c_str(), scheme.length(), f);
+        }
+        if (authority) {
+            pseudo(":authority", authority, authority_end - authority, f);
+        } else if (host) {
+            pseudo(":authority", host->value, host->value_length, f);
+        }
+        if (path < sp2 && (*path == '/' || !authority)) {
+            pseudo(":path", path, sp2 - path, f);
+        } else {
+            // http://host or http://host?query: the path is empty, which
+            // :path can't be (RFC 7540 section 8.1.2.3).
+            name = ":path";
+            value = "/";
+            value.append(path, sp2);
+            f(HeaderTokens::get().find(name), name, value);
+        }
+        return true;
+    }
+};
+
+} // namespace
@@ -0,0 +1,305 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
+#include "pack.h"
+#include "config.h"
+
+// A corpus file, parsed once and shared by all trials. Each story is
+// encoded as its own connection.
+struct Story {
+    const char *path;
+    vector<HeaderList> blocks;
+};
+
+struct TrialResult {
+    size_t bytes;
+    // Encoder CPU time, the fastest of the iterations
+    uint64_t ns;
+    bool valid;
+};
+
+static uint64_t thread_cpu_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class Tuner {
+    const PackState& proto;
+    const vector<Story>& stories;
+    const unsigned iterations;
+    // Output bytes that a microsecond of encoder CPU time is worth
+    const double cpu_weight;
+
+    TrialResult run(const EncoderConfig& config) const {
+        TrialResult result = { 0, UINT64_MAX, true };
+        for (unsigned i = 0; i < iterations; i++) {
+            result.bytes = 0;
+            uint64_t start = thread_cpu_ns();
+            for (const Story& story : stories) {
+                PackState state = proto.fork();
+                config.apply(state);
+                for (const HeaderList& headers : story.blocks) {
+                    result.valid &= state.pack_block(headers);
+                    result.bytes += state.get_output().size();
+                    state.clear_output();
+                }
+            }
+            result.ns = std::min(result.ns, thread_cpu_ns() - start);
+        }
+        return result;
+    }
+
+public:
+    Tuner(const PackState& proto, const vector<Story>& stories, unsigned iterations, double cpu_weight):
+        proto(proto), stories(stories), iterations(iterations), cpu_weight(cpu_weight) {}
+
+    double score(const TrialResult& r) const {
+        return r.bytes + cpu_weight * r.ns / 1000.0;
+    }
+
+    // Runs a trial for each config, spread over threads.
+    vector<TrialResult> evaluate(const vector<EncoderConfig>& configs) const {
+        vector<TrialResult> results(configs.size());
+        parallel_for(configs.size(), [&](size_t c) {
+            results[c] = run(configs[c]);
+        });
+        return results;
+    }
+
+    // Returns the index of the config with the best score, or configs.size()
+    // if there are none.
+    size_t best(const vector<EncoderConfig>& configs, vector<TrialResult>& results) const {
+        results = evaluate(configs);
+        size_t b = configs.size();
+        for (size_t i = 0; i < results.size(); i++) {
+            if (b == configs.size() || score(results[i]) < score(results[b])) {
+                b = i;
+            }
+        }
+        return b;
+    }
+};
+
+// The global settings: table size (up to the peer's), oversized entry
+// cutoff, default policy and volatility tracking.
+static vector<EncoderConfig> grid(unsigned settings_table_size)
+{
+    static const unsigned percents[] = { 25, 50, 75, 100 };
+    static const IndexPolicy policies[] = { INDEX, INDEX_NAME, NO_INDEX };
+    // A quarter, half and all of the peer's size (which may be 0)
+    set<unsigned> sizes = { settings_table_size / 4, settings_table_size / 2, settings_table_size };
+    vector<EncoderConfig> configs;
+    for (unsigned size : sizes) {
+        for (unsigned percent : percents) {
+            for (IndexPolicy policy : policies) {
+                for (bool volatility : { true, false }) {
+                    EncoderConfig c;
+                    c.table_size = size;
+                    c.max_entry_percent = percent;
+                    c.default_policy = policy;
+                    c.volatility = volatility;
+                    configs.push_back(c);
+                }
+            }
+        }
+    }
+    return configs;
+}
+
+// The names with the most header bytes in the corpus, lowercased like the
+// encoder does, except those with a sensitive (never indexed) policy.
+static vector<string> top_names(const PackState& proto, const vector<Story>& stories, size_t count)
+{
+    map<string, size_t> bytes;
+    string lowercase;
+    for (const Story& story : stories) {
+        for (const HeaderList& headers : story.blocks) {
+            for (const Header& h : headers) {
+                if (const string *name = normalize_field(h.first, h.second, lowercase)) {
+                    bytes[*name] += h.first.size() + h.second.size();
+                }
+            }
+        }
+    }
+    // Long enough not to count as a short cookie
+    const string value(proto.policy.short_cookie_length, 'x');
+    vector<std::pair<size_t, string>> by_bytes;
+    for (const auto& b : bytes) {
+        if (proto.policy.get(b.first, value) != NEVER_INDEX) {
+            by_bytes.push_back(std::make_pair(b.second, b.first));
+        }
+    }
+    std::sort(by_bytes.rbegin(), by_bytes.rend());
+    vector<string> names;
+    for (size_t i = 0; i < by_bytes.size() && i < count; i++) {
+        names.push_back(by_bytes[i].second);
+    }
+    return names;
+}
+
+// Returns false if name already has that policy.
+static bool set_policy(EncoderConfig& config, const string& name, IndexPolicy policy)
+{
+    for (auto& p : config.policies) {
+        if (p.first == name) {
+            if (p.second == policy) {
+                return false;
+            }
+            p.second = policy;
+            return true;
+        }
+    }
+    if (policy == config.default_policy) {
+        return false;
+    }
+    config.policies.push_back(std::make_pair(name, policy));
+    return true;
+}
+
+static void report(const char *what, const TrialResult& r, size_t header_bytes)
+{
+    fprintf(stderr, "%s: %zu bytes (%.1f%%), %.1f ms\n", what, r.bytes,
+            100.0 * r.bytes / header_bytes, r.ns / 1e6);
+}
+
+// Searches encoder settings for the smallest output on the corpus files
+// given as arguments (in hpack's input format), or with -w, the best
+// tradeoff of size and encoder CPU time, and writes the best as a config
+// file for hpack -C.
+//
+// The search tries every combination of the global settings, then changes
+// the policy of one of the most common headers at a time while that helps.
+int main(int argc, const char *argv[])
+{
+    PackState proto;
+    const char *output_path = nullptr;
+    size_t name_count = 16;
+    unsigned iterations = 1;
+    double cpu_weight = 0;
+    unsigned settings_table_size = 4096;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "cS:n:i:w:o:")) != -1) {
+        switch (opt) {
+        case 'c':
+            proto.crumble_cookies = true;
+            break;
+        case 'S':
+            settings_table_size = atoi(optarg);
+            proto.set_settings_table_size(settings_table_size);
+            break;
+        case 'n':
+            name_count = atoi(optarg);
+            break;
+        case 'i':
+            iterations = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            cpu_weight = atof(optarg);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-S settings_size] [-n names] [-i iterations] [-w bytes_per_us] [-o config] corpus...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "%s: no corpus files\n", argv[0]);
+        return 1;
+    }
+
+    vector<Story> stories;
+    size_t header_bytes = 0;
+    for (int i = optind; i < argc; i++) {
+        string contents;
+        if (!read_file(argv[i], contents)) {
+            fprintf(stderr, "Can't read %s\n", argv[i]);
+            return 1;
+        }
+        stories.push_back(Story{ argv[i], parse_header_blocks(contents) });
+        for (const HeaderList& headers : stories.back().blocks) {
+            for (const Header& h : headers) {
+                header_bytes += h.first.size() + h.second.size();
+            }
+        }
+    }
+    if (!header_bytes) {
+        fprintf(stderr, "%s: no headers\n", argv[0]);
+        return 1;
+    }
+
+    const Tuner tuner(proto, stories, iterations, cpu_weight);
+
+    EncoderConfig defaults;
+    defaults.table_size = settings_table_size;
+    TrialResult default_result = tuner.evaluate({ defaults })[0];
+    if (!default_result.valid) {
+        fprintf(stderr, "%s: invalid header field\n", argv[0]);
+        return 1;
+    }
+    fprintf(stderr, "%zu stories, %zu header bytes\n", stories.size(), header_bytes);
+    report("defaults", default_result, header_bytes);
+
+    vector<TrialResult> results;
+    vector<EncoderConfig> configs = grid(settings_table_size);
+    size_t b = tuner.best(configs, results);
+    EncoderConfig best = defaults;
+    TrialResult best_result = default_result;
+    if (b < configs.size() && tuner.score(results[b]) < tuner.score(best_result)) {
+        best = configs[b];
+        best_result = results[b];
+    }
+    fprintf(stderr, "%zu global settings tried\n", configs.size());
+    report("best global settings", best_result, header_bytes);
+
+    const vector<string> names = top_names(proto, stories, name_count);
+    for (;;) {
+        configs.clear();
+        for (const string& name : names) {
+            for (IndexPolicy policy : { INDEX, INDEX_NAME, NO_INDEX }) {
+                EncoderConfig c = best;
+                if (set_policy(c, name, policy)) {
+                    configs.push_back(c);
+                }
+            }
+        }
+        if (configs.empty()) {
+            break;
+        }
+        b = tuner.best(configs, results);
+        if (b == configs.size() || tuner.score(results[b]) >= tuner.score(best_result)) {
+            break;
+        }
+        best = configs[b];
+        best_result = results[b];
+    }
+    report("best", best_result, header_bytes);
+
+    char comment[160];
+    snprintf(comment, sizeof(comment), "# htune: %zu stories, %zu bytes (%.1f%%), %zu with the defaults\n",
+            stories.size(), best_result.bytes, 100.0 * best_result.bytes / header_bytes, default_result.bytes);
+    const string output = comment + best.format();
+    FILE *fp = output_path ? fopen(output_path, "w") : stdout;
+    if (!fp) {
+        fprintf(stderr, "Can't write %s\n", output_path);
+        return 1;
+    }
+    fwrite(output.c_str(), 1, output.length(), fp);
+    if (output_path) {
+        fclose(fp);
+    }
+}
@@ -1,18 +1,155 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "governor.h"
+#include "tracepoint.h"
+#include "metrics.h"
+#include "validate.h"
 #include "unpack.h"
 
 int main(int argc, const char *argv[])
 {
     UnpackState state;
+    bool stats = false;
+    bool tokens = false;
+    bool flat = false;
+    bool http1 = false;
+    bool batch = false;
+
+    int opt;
+    while ((opt = getopt(argc, (char **)argv, "Bcd:sTFHl:x:S:Em")) != -1) {
+        switch (opt) {
+        case 'B':
+            batch = true;
+            break;
+        case 'E':
+            // Dump the trace to stderr at exit
+            Tracepoints::enable(true);
+            atexit([]() {
+                Tracepoints::get().dump(stderr);
+            });
+            break;
+        case 'm':
+            // Print the codec metrics to stderr at exit
+            state.use_metrics(CodecMetrics::get());
+            atexit([]() {
+                CodecMetrics::print(stderr, "decoder", CodecMetrics::get().snapshot().decoder);
+            });
+            break;
+        case 'c':
+            state.combine_cookies = true;
+            break;
+        case 'd':
+            {
+                HeaderList profile;
+                if (!read_table_profile(optarg, profile)) {
+                    fprintf(stderr, "Can't read table profile %s\n", optarg);
+                    return 1;
+                }
+                state.load_profile(profile);
+                break;
+            }
+        case 'F':
+            flat = true;
+            break;
+        case 'H':
+            http1 = true;
+            break;
+        case 'T':
+            tokens = true;
+            break;
+        case 'S':
+            state.set_settings_table_size(atoi(optarg));
+            break;
+        case 'l':
+            state.max_header_list_size = atoi(optarg);
+            break;
+        case 'x':
+            state.max_expansion_ratio = atoi(optarg);
+            break;
+        case 's':
+            stats = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-B] [-c] [-E] [-d profile] [-m] [-s] [-T] [-F] [-H] [-l max_header_list_size] [-x max_expansion_ratio] [-S settings_size]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (batch) {
+        // Frames from hpack -B, printed as "@id", the headers and an empty
+        // line each, with a decoder per connection.
+        map<string, UnpackState> connections;
+        const string input = read_fully(stdin);
+        const uint8_t *pos = (const uint8_t*)input.c_str();
+        const uint8_t *const end = pos + input.size();
+        string id;
+        while (pos < end) {
+            const uint8_t *block;
+            size_t length;
+            UnpackError error = get_frame(pos, end, id, block, length);
+            if (!error) {
+                auto c = connections.find(id);
+                if (c == connections.end()) {
+                    c = connections.insert(std::make_pair(id, state.fork())).first;
+                }
+                UnpackState& s = c->second;
+                s.feed(string((const char*)block, length));
+                printf("@%s\n", id.c_str());
+                error = s.unpack([](const string& name, const string& value) {
+                    printf("%s: %s\n", name.c_str(), value.c_str());
+                });
+                printf("\n");
+            }
+            if (error) {
+                fprintf(stderr, "%s: %s\n", argv[0], unpack_error_string(error));
+                return 1;
+            }
+        }
+        return 0;
+    }
+
     state.feed(read_fully(stdin));
-    state.unpack([](const string& name, const string& value) {
-        printf("%s: %s\n", name.c_str(), value.c_str());
-        debug("=> %s: %s\n", name.c_str(), value.c_str());
-    });
+    UnpackError error;
+    if (http1) {
+        string out;
+        error = state.unpack_http1(out);
+        fwrite(out.c_str(), 1, out.length(), stdout);
+    } else if (flat) {
+        FlatHeaderBlock block;
+        error = state.unpack_flat(block);
+        for (const FlatHeader& f : block.fields) {
+            if (tokens) {
+                printf("[%u] ", f.token);
+            }
+            printf("%.*s: %.*s\n", (int)f.name_length, block.name(f),
+                    (int)f.value_length, block.value(f));
+        }
+    } else {
+        error = state.unpack_tokens([tokens](HeaderToken token, const string& name, const string& value) {
+            if (tokens) {
+                printf("[%u] ", token);
+            }
+            printf("%s: %s\n", name.c_str(), value.c_str());
+            debug("=> %s: %s\n", name.c_str(), value.c_str());
+        });
+    }
+    if (error) {
+        fprintf(stderr, "%s: %s\n", argv[0], unpack_error_string(error));
+        return 1;
+    }
     state.eof();
+
+    if (stats) {
+        const HuffmanCache& cache = state.get_huffman_cache();
+        size_t lookups = cache.hits + cache.misses;
+        fprintf(stderr, "huffman cache: %zu hits, %zu misses (%.0f%%)\n",
+                cache.hits, cache.misses,
+                lookups ? 100.0 * cache.hits / lookups : 0.0);
+    }
 }
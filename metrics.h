@@ -0,0 +1,154 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+// Counters kept by each encoder and decoder that uses CodecMetrics.
+enum Metric {
+    // Fields found in the static or the dynamic table
+    METRIC_STATIC_HITS,
+    METRIC_DYNAMIC_HITS,
+    // Fields with only the name found in a table
+    METRIC_NAME_HITS,
+    // Fields with a literal name
+    METRIC_LITERALS,
+    // Bytes saved by Huffman coding (encoder only)
+    METRIC_HUFFMAN_SAVED,
+    METRIC_INSERTS,
+    METRIC_EVICTIONS,
+    // Header bytes (names and values) into the encoder or out of the
+    // decoder, HPACK bytes the other way.
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_BLOCKS,
+    METRIC_BLOCK_NANOSECONDS,
+    METRIC_COUNT
+};
+
+inline const char *metric_name(Metric m)
+{
+    static const char *const names[METRIC_COUNT] = {
+        "static_hits", "dynamic_hits", "name_hits", "literals", "huffman_saved",
+        "inserts", "evictions", "bytes_in", "bytes_out", "blocks", "block_ns",
+    };
+    return names[m];
+}
+
+struct MetricValues {
+    uint64_t values[METRIC_COUNT];
+
+    MetricValues() {
+        std::fill(values, values + METRIC_COUNT, 0);
+    }
+
+    uint64_t operator[](Metric m) const {
+        return values[m];
+    }
+};
+
+inline uint64_t metric_clock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The counters of one encoder or decoder. Only the owner writes them, so
+// they're updated without atomic read-modify-writes, and can be read from
+// any thread.
+class MetricCounters {
+    std::atomic<uint64_t> values[METRIC_COUNT];
+
+public:
+    MetricCounters() {
+        for (auto& v : values) {
+            v.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(Metric m, uint64_t n) {
+        values[m].store(values[m].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void read(MetricValues& out) const {
+        for (size_t i = 0; i < METRIC_COUNT; i++) {
+            out.values[i] += values[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Process-wide totals of all encoders and decoders, including those that
+// are gone. A snapshot can be taken at any time; encoders and decoders keep
+// going meanwhile (and only take the lock when they're created or
+// destroyed).
+class CodecMetrics {
+public:
+    typedef std::shared_ptr<MetricCounters> CountersPtr;
+
+    struct Snapshot {
+        MetricValues encoder, decoder;
+    };
+
+    static CodecMetrics& get() {
+        static CodecMetrics metrics;
+        return metrics;
+    }
+
+    // The counters are folded into the totals when the last copy of the
+    // pointer goes away.
+    CountersPtr open(bool encoder) {
+        MetricCounters *counters = new MetricCounters();
+        std::lock_guard<std::mutex> guard(lock);
+        (encoder ? encoders : decoders).insert(counters);
+        return CountersPtr(counters, [this, encoder](MetricCounters *counters) {
+            close(counters, encoder);
+        });
+    }
+
+    Snapshot snapshot() {
+        Snapshot s;
+        std::lock_guard<std::mutex> guard(lock);
+        s.encoder = closed_encoders;
+        s.decoder = closed_decoders;
+        for (const MetricCounters *c : encoders) {
+            c->read(s.encoder);
+        }
+        for (const MetricCounters *c : decoders) {
+            c->read(s.decoder);
+        }
+        return s;
+    }
+
+    static void print(FILE *fp, const char *what, const MetricValues& v) {
+        fprintf(fp, "%s:", what);
+        for (size_t i = 0; i < METRIC_COUNT; i++) {
+            fprintf(fp, " %s %llu", metric_name(Metric(i)), (unsigned long long)v.values[i]);
+        }
+        uint64_t fields = v[METRIC_STATIC_HITS] + v[METRIC_DYNAMIC_HITS] + v[METRIC_NAME_HITS] + v[METRIC_LITERALS];
+        if (fields) {
+            fprintf(fp, ", hit rate %.1f%%, name hit rate %.1f%%",
+                    100.0 * (v[METRIC_STATIC_HITS] + v[METRIC_DYNAMIC_HITS]) / fields,
+                    100.0 * v[METRIC_NAME_HITS] / fields);
+        }
+        uint64_t header_bytes = std::max(v[METRIC_BYTES_IN], v[METRIC_BYTES_OUT]);
+        if (header_bytes) {
+            fprintf(fp, ", ratio %.1f%%", 100.0 * std::min(v[METRIC_BYTES_IN], v[METRIC_BYTES_OUT]) / header_bytes);
+        }
+        fprintf(fp, "\n");
+    }
+
+private:
+    std::mutex lock;
+    set<MetricCounters*> encoders, decoders;
+    MetricValues closed_encoders, closed_decoders;
+
+    void close(MetricCounters *counters, bool encoder) {
+        std::lock_guard<std::mutex> guard(lock);
+        (encoder ? encoders : decoders).erase(counters);
+        counters->read(encoder ? closed_encoders : closed_decoders);
+        delete counters;
+    }
+};
+
+} // namespace
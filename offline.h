@@ -0,0 +1,150 @@
+namespace {
+
+const uint64_t NO_NEXT_OCCURRENCE = UINT64_MAX;
+
+// Offline encoding of a header sequence that is known in advance. Instead of
+// guessing, the encoder looks at where each field occurs next: values that
+// come back before they would have been evicted are indexed, names that come
+// back are indexed by name only, and everything else is sent without
+// indexing so that it doesn't push out anything useful.
+//
+// How far ahead "before they would have been evicted" is depends on the
+// decisions for everything in between, so rather than searching over table
+// states, a few different horizons are tried (in parallel) and the smallest
+// output wins. The result is a normal HPACK stream either way.
+class OfflinePacker {
+    struct Field {
+        HeaderToken token;
+        Header header;
+        IndexPolicy policy;
+        bool last_in_block;
+        // Sum of entry sizes of all fields before this one, and the same for
+        // the next occurrence of the same field and name.
+        uint64_t offset;
+        uint64_t next_field;
+        uint64_t next_name;
+    };
+
+    const PackState& proto;
+    vector<Field> fields;
+
+    void add_field(HeaderToken token, const string& name, const string& value, IndexPolicy policy, uint64_t& offset) {
+        fields.push_back({ token, Header(name, value), policy, false, offset, NO_NEXT_OCCURRENCE, NO_NEXT_OCCURRENCE });
+        offset += 32 + name.length() + value.length();
+    }
+
+    void find_next_occurrences() {
+        map<Header, uint64_t> next_field;
+        map<string, uint64_t> next_name;
+        for (auto p = fields.rbegin(); p != fields.rend(); p++) {
+            uint64_t& field = next_field[p->header];
+            p->next_field = field ? field : NO_NEXT_OCCURRENCE;
+            field = p->offset;
+            uint64_t& name = next_name[p->header.first];
+            p->next_name = name ? name : NO_NEXT_OCCURRENCE;
+            name = p->offset;
+        }
+    }
+
+    IndexPolicy choose(const Field& f, uint64_t horizon) const {
+        if (f.policy != INDEX) {
+            return f.policy;
+        }
+        if (f.next_field != NO_NEXT_OCCURRENCE && f.next_field - f.offset <= horizon) {
+            return INDEX;
+        } else if (f.next_name != NO_NEXT_OCCURRENCE && f.next_name - f.offset <= horizon) {
+            return INDEX_NAME;
+        } else {
+            return NO_INDEX;
+        }
+    }
+
+    string pack_with_horizon(PackState state, uint64_t horizon) const {
+        state.volatility.enabled = false;
+        for (const Field& f : fields) {
+            state.pack_field(f.token, f.header.first, f.header.second, choose(f, horizon));
+            if (f.last_in_block) {
+                state.end_block();
+            }
+        }
+        return state.get_output();
+    }
+
+    // The normal online encoding, in case it does better.
+    string pack_online(PackState state) const {
+        for (const Field& f : fields) {
+            state.pack_field(f.token, f.header.first, f.header.second, f.policy);
+            if (f.last_in_block) {
+                state.end_block();
+            }
+        }
+        return state.get_output();
+    }
+
+public:
+    // Horizons to try, in multiples of the table size. The last one means
+    // "index anything that occurs again".
+    static const vector<double>& horizons() {
+        static const vector<double> h = { 0.5, 0.75, 1, 1.25, 1.5, 2, 3, 1e9 };
+        return h;
+    }
+
+    // False if the blocks have a field HTTP/2 can't carry, see
+    // normalize_field().
+    bool valid;
+
+    // proto is used as the starting state (table size, policies, ...) and
+    // must outlive the packer.
+    OfflinePacker(PackState& proto, const vector<HeaderList>& blocks): proto(proto), valid(true) {
+        uint64_t offset = 1; // 0 means no next occurrence in the maps
+        string lowercase;
+        for (const HeaderList& headers : blocks) {
+            for (const Header& h : headers) {
+                const string *n = normalize_field(h.first, h.second, lowercase);
+                if (!n) {
+                    valid = false;
+                    return;
+                }
+                HeaderToken token = HeaderTokens::get().find(*n);
+                const IndexPolicy policy = proto.policy.get(token, *n, h.second);
+                proto.for_each_field(*n, h.second, [&](const string& name, const string& value) {
+                    add_field(token, name, value, policy, offset);
+                });
+            }
+            if (fields.size()) {
+                fields.back().last_in_block = true;
+            }
+        }
+        find_next_occurrences();
+    }
+
+    // The trials don't count towards the memory governor or metrics. The
+    // winner is encoded once more with proto's accounts, so that only it
+    // counts.
+    string pack() const {
+        const vector<double>& h = horizons();
+        vector<uint64_t> horizon(h.size());
+        vector<string> results(h.size() + 1);
+        for (size_t i = 0; i < h.size(); i++) {
+            horizon[i] = h[i] * proto.max_table_size();
+        }
+        // The last one is the online encoder.
+        parallel_for(results.size(), [&](size_t i) {
+            results[i] = i < h.size() ? pack_with_horizon(proto.fork_trial(), horizon[i]) : pack_online(proto.fork_trial());
+        });
+
+        size_t best = results.size() - 1;
+        for (size_t i = 0; i < results.size(); i++) {
+            debug("offline: horizon %zu => %zu bytes\n", i, results[i].size());
+            if (results[i].size() < results[best].size()) {
+                best = i;
+            }
+        }
+        if (best == h.size()) {
+            return pack_online(proto.fork());
+        }
+        return pack_with_horizon(proto.fork(), horizon[best]);
+    }
+};
+
+} // namespace
@@ -0,0 +1,704 @@
+#include <atomic>
+
+namespace {
+const bool USE_HUFFMAN = true;
+
+void put8(string& out, uint8_t v)
+{
+    out += (char)v;
+}
+
+// The longest encoding of a 32-bit value: the prefix byte and five
+// continuation bytes.
+const size_t MAX_INT_LENGTH = 6;
+
+uint8_t *put_vint(uint8_t *out, unsigned value)
+{
+    while (value >= 0x80) {
+        *out++ = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+// Writes an integer with a prebits-bit prefix into out, which must have room
+// for MAX_INT_LENGTH bytes. Returns the end of the integer.
+uint8_t *put_int(uint8_t *out, uint8_t prebyte, unsigned prebits, unsigned value)
+{
+    const unsigned maxval = (1 << prebits) - 1;
+    if (value < maxval) {
+        *out++ = prebyte | value;
+        return out;
+    }
+    *out++ = prebyte | maxval;
+    return put_vint(out, value - maxval);
+}
+
+void put_int(string& out, uint8_t prebyte, unsigned prebits, unsigned value)
+{
+    uint8_t buf[MAX_INT_LENGTH];
+    out.append((const char*)buf, put_int(buf, prebyte, prebits, value) - buf);
+}
+
+unsigned drain(string& out, unsigned& bits, unsigned len)
+{
+    while (len >= 8) {
+        len -= 8;
+        out += (char)(uint8_t)(bits >> len);
+        bits &= (1 << len) - 1;
+    }
+    return len;
+}
+
+string huff(const string &h)
+{
+    unsigned bits = 0;
+    unsigned n = 0;
+
+    string out;
+    const char *p = h.c_str();
+    while (uint8_t c = *p++) {
+        uint32_t code = huff_codes[c];
+        unsigned len = huff_lengths[c];
+        if (len > 24) {
+            // The top bits first, so that bits never holds more than 31
+            bits <<= len - 24;
+            bits |= code >> 24;
+            n += len - 24;
+            len = 24;
+            code &= 0xffffff;
+            n = drain(out, bits, n);
+        }
+        bits <<= len;
+        bits |= code;
+        n = drain(out, bits, n + len);
+    }
+    if (n) {
+        bits <<= 7;
+        bits |= 0x7f;
+        n = drain(out, bits, n + 7);
+    }
+    return out;
+}
+
+// Huffman-encoded strings shared by all encoders in the process, since the
+// same server names, content types, origins etc. get encoded on every
+// connection.
+//
+// Lookups are a hash and an atomic load, so encoders on different threads
+// never write to shared memory for a hit. Entries are immutable and inserted
+// with a compare-and-swap into empty slots only, so they're never freed while
+// someone might be reading them. Nothing is evicted either: the cache is
+// capped at MAX_BYTES, and to keep one-off values from filling it up, a value
+// is only admitted the second time its slot sees it.
+class SharedHuffmanCache {
+    struct Entry {
+        string value, encoded;
+    };
+
+    static const size_t SLOTS = 4096;
+    static const size_t MAX_LENGTH = 256;
+    static const size_t MAX_BYTES = 1 << 20;
+
+    std::atomic<const Entry*> slots[SLOTS];
+    // Hash of the last value that missed in each slot.
+    std::atomic<uint32_t> candidates[SLOTS];
+    std::atomic<size_t> bytes_used;
+
+    SharedHuffmanCache(): bytes_used(0) {
+        for (size_t i = 0; i < SLOTS; i++) {
+            slots[i].store(nullptr, std::memory_order_relaxed);
+            candidates[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    static SharedHuffmanCache& get() {
+        static SharedHuffmanCache cache;
+        return cache;
+    }
+
+    // Returns the Huffman encoding of value, either from the cache or
+    // encoded into tmp.
+    const string& encode(const string& value, string& tmp) {
+        if (value.length() > MAX_LENGTH) {
+            return tmp = huff(value);
+        }
+        const uint32_t hash = hash_bytes(value.data(), value.length());
+        const size_t i = hash % SLOTS;
+        const Entry *e = slots[i].load(std::memory_order_acquire);
+        if (e && e->value == value) {
+            return e->encoded;
+        }
+
+        tmp = huff(value);
+        if (!e && candidates[i].exchange(hash, std::memory_order_relaxed) == hash) {
+            admit(i, value, tmp);
+        }
+        return tmp;
+    }
+
+private:
+    void admit(size_t i, const string& value, const string& encoded) {
+        size_t size = sizeof(Entry) + value.length() + encoded.length();
+        if (bytes_used.fetch_add(size, std::memory_order_relaxed) + size > MAX_BYTES) {
+            bytes_used.fetch_sub(size, std::memory_order_relaxed);
+            return;
+        }
+        const Entry *expected = nullptr;
+        const Entry *e = new Entry{ value, encoded };
+        if (!slots[i].compare_exchange_strong(expected, e, std::memory_order_release, std::memory_order_relaxed)) {
+            // Someone else got there first
+            delete e;
+            bytes_used.fetch_sub(size, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Returns the number of bytes saved by Huffman coding.
+size_t put_string(string& out, const string &s, bool huffman = USE_HUFFMAN)
+{
+    if (huffman) {
+        string tmp;
+        const string& h = SharedHuffmanCache::get().encode(s, tmp);
+        tracepoint(HUFFMAN, TRACE_ENCODER, s.size(), h.size());
+        if (h.size() < s.size()) {
+            put_int(out, 0x80, 7, h.size());
+            out += h;
+            return s.size() - h.size();
+        }
+    }
+    put_int(out, 0, 7, s.size());
+    out += s;
+    return 0;
+}
+
+// How a header may use the dynamic table. Full matches in the table are
+// used for everything but NEVER_INDEX.
+enum IndexPolicy {
+    // Literal with incremental indexing (0x40) when there's no full match.
+    INDEX,
+    // Add the first value to the table so that the name can be indexed, but
+    // send later values as literals without indexing.
+    INDEX_NAME,
+    // Literal without indexing (0x00).
+    NO_INDEX,
+    // Literal never indexed (0x10), for sensitive values. Intermediaries
+    // must keep it that way when forwarding it.
+    NEVER_INDEX,
+};
+
+inline bool parse_index_policy(const char *s, IndexPolicy& policy)
+{
+    if (!strcmp(s, "index")) {
+        policy = INDEX;
+    } else if (!strcmp(s, "name")) {
+        policy = INDEX_NAME;
+    } else if (!strcmp(s, "literal")) {
+        policy = NO_INDEX;
+    } else if (!strcmp(s, "never")) {
+        policy = NEVER_INDEX;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char *index_policy_name(IndexPolicy policy)
+{
+    static const char *const names[] = { "index", "name", "literal", "never" };
+    return names[policy];
+}
+
+class HeaderPolicy {
+    // Names in the static table are looked up by their (first) static index,
+    // everything else by name.
+    IndexPolicy static_policy[dynamic_table_start];
+    bool static_policy_set[dynamic_table_start];
+    map<string, IndexPolicy> other_policy;
+
+public:
+    // Cookies shorter than this are easy to brute force by probing the
+    // table, so they're never indexed. The length is that of the whole
+    // header, not of the crumbs. 0 turns this off.
+    unsigned short_cookie_length;
+    // For headers without a policy of their own
+    IndexPolicy default_policy;
+
+    HeaderPolicy(): short_cookie_length(20), default_policy(INDEX) {
+        std::fill(static_policy, static_policy + dynamic_table_start, INDEX);
+        std::fill(static_policy_set, static_policy_set + dynamic_table_start, false);
+        set("authorization", NEVER_INDEX);
+        set("proxy-authorization", NEVER_INDEX);
+        set("set-cookie", NEVER_INDEX);
+    }
+
+    void set(const string& name, IndexPolicy policy) {
+        if (size_t i = find_static(name)) {
+            static_policy[i] = policy;
+            static_policy_set[i] = true;
+        } else {
+            other_policy[name] = policy;
+        }
+    }
+
+    IndexPolicy get(const string& name, const string& value) const {
+        return get(HeaderTokens::get().find(name), name, value);
+    }
+
+    IndexPolicy get(HeaderToken token, const string& name, const string& value) const {
+        IndexPolicy policy = default_policy;
+        if (is_static_token(token)) {
+            if (static_policy_set[token]) {
+                policy = static_policy[token];
+            }
+        } else if (other_policy.size()) {
+            auto p = other_policy.find(name);
+            if (p != other_policy.end()) {
+                policy = p->second;
+            }
+        }
+        if (policy < NEVER_INDEX && name == "cookie"
+                && value.length() < short_cookie_length) {
+            policy = NEVER_INDEX;
+        }
+        return policy;
+    }
+};
+
+// Learns which headers have values that are never referenced again before
+// they're evicted (dates, request ids, content lengths, ...), so that they
+// can stop pushing useful entries out of the table.
+class VolatilityTracker {
+    struct Score {
+        // Goes down for each wasted entry and up for each entry that was
+        // used, saturating in both directions.
+        int8_t score;
+        // Values not indexed since the name was considered volatile.
+        uint8_t skipped;
+
+        Score(): score(0), skipped(0) {}
+    };
+
+    // Other names share scores by hash, so the memory used stays bounded
+    // whatever names the peer sends. A collision only mixes two names'
+    // scores.
+    static const size_t OTHER_SLOTS = 256;
+    Score static_score[dynamic_table_start];
+    Score other_score[OTHER_SLOTS];
+
+    Score& get(HeaderToken token, const string& name) {
+        if (is_static_token(token)) {
+            return static_score[token];
+        }
+        return other_score[hash_bytes(name.data(), name.length()) % OTHER_SLOTS];
+    }
+
+public:
+    static const int8_t VOLATILE_SCORE = -4;
+    static const int8_t MIN_SCORE = -16;
+    static const int8_t MAX_SCORE = 16;
+    // Values referenced after insertion count for more than wasted ones,
+    // since a full match saves much more than the insertion wastes.
+    static const int8_t REFERENCED_BONUS = 4;
+    // Index every Nth value anyway, so that the score can recover if the
+    // values stop changing.
+    static const uint8_t RETRY_INTERVAL = 16;
+
+    bool enabled;
+
+    VolatilityTracker(): enabled(true) {}
+
+    // Whether to avoid indexing a new value for this name.
+    bool is_volatile(HeaderToken token, const string& name) {
+        if (!enabled) {
+            return false;
+        }
+        Score& s = get(token, name);
+        if (s.score > VOLATILE_SCORE) {
+            return false;
+        }
+        if (++s.skipped >= RETRY_INTERVAL) {
+            debug("retrying volatile %s (score %d)\n", name.c_str(), s.score);
+            s.skipped = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void evicted(const TableEntry& e) {
+        if (!enabled) {
+            return;
+        }
+        Score& s = get(e.token, e.name);
+        if (e.referenced) {
+            s.score = std::min<int>(MAX_SCORE, s.score + REFERENCED_BONUS);
+        } else if (s.score > MIN_SCORE) {
+            s.score--;
+        }
+        debug("evicted %sreferenced %s, score %d\n", e.referenced ? "" : "un", e.name.c_str(), s.score);
+    }
+};
+
+class PackState {
+    DynamicTable dyn_table;
+    unsigned max_dynamic_size;
+    string output;
+    string crumb;
+    // Reused for names that need lowercasing
+    string lowercase_name;
+
+    // SETTINGS_HEADER_TABLE_SIZE from the peer, the largest table size the
+    // encoder may use.
+    unsigned settings_table_size;
+    // Size changes take effect at the start of the next header block, where
+    // the smallest and the final size are signaled to the decoder.
+    bool size_update_pending;
+    unsigned min_pending_size;
+    unsigned pending_size;
+    bool block_start;
+    // The size asked for with set_table_size, before applying the limits
+    // from the peer and the memory governor.
+    unsigned wanted_table_size;
+
+    TableMemoryGovernor *governor;
+    TableMemoryGovernor::AccountPtr memory_account;
+
+    CodecMetrics *codec_metrics;
+    CodecMetrics::CountersPtr metrics;
+    // Where the current block started in the output, and when
+    size_t block_offset;
+    uint64_t block_time;
+
+    BlockCache<HeaderList, string> block_cache;
+
+    // Only through fork(), so that copies get their own accounts.
+    PackState(const PackState&) = default;
+    PackState& operator=(const PackState&) = delete;
+
+public:
+    HeaderPolicy policy;
+    VolatilityTracker volatility;
+
+    // Split cookie headers into separately indexable crumbs, as allowed by
+    // RFC 7540 section 8.1.2.5. The decoder needs to combine them again.
+    bool crumble_cookies;
+    // Fields larger than this percentage of the table aren't indexed, so
+    // that one field doesn't evict everything else.
+    unsigned max_entry_percent;
+    // Huffman-code strings where that makes them shorter. Off for output
+    // that is compressed again anyway (see archive.h).
+    bool huffman;
+
+    PackState(): max_dynamic_size(4096), settings_table_size(4096),
+        size_update_pending(false), min_pending_size(0), pending_size(0),
+        block_start(true), wanted_table_size(4096), governor(nullptr),
+        codec_metrics(nullptr), block_offset(0), block_time(0),
+        crumble_cookies(false), max_entry_percent(75), huffman(USE_HUFFMAN) {}
+    PackState(PackState&&) = default;
+    PackState& operator=(PackState&&) = default;
+
+    // The peer changed SETTINGS_HEADER_TABLE_SIZE. If the table is larger
+    // than the new limit, it shrinks at the start of the next block.
+    void set_settings_table_size(unsigned size) {
+        settings_table_size = size;
+        update_table_size();
+    }
+
+    // Changes the size of the table used by the encoder, e.g. to use less
+    // memory than the peer allows, at the start of the next block.
+    void set_table_size(unsigned size) {
+        wanted_table_size = size;
+        update_table_size();
+    }
+
+    // Account for the table's memory in the governor, and shrink the table
+    // when it says so.
+    void use_memory_governor(TableMemoryGovernor& g) {
+        governor = &g;
+        memory_account = g.open(true);
+    }
+
+    // Count what the encoder does in m, see metrics.h.
+    void use_metrics(CodecMetrics& m) {
+        codec_metrics = &m;
+        metrics = m.open(true);
+    }
+
+    // A copy of this state (settings, policies and table) for another
+    // connection, with its own memory account.
+    PackState fork() const {
+        PackState state = *this;
+        if (governor) {
+            state.use_memory_governor(*governor);
+        }
+        if (codec_metrics) {
+            state.use_metrics(*codec_metrics);
+        }
+        return state;
+    }
+
+    // A copy for trying out an encoding that may be thrown away, without a
+    // memory account or metrics, so that it doesn't count anywhere.
+    PackState fork_trial() const {
+        PackState state = *this;
+        state.memory_account.reset();
+        state.metrics.reset();
+        return state;
+    }
+
+    // Start from a table profile that the decoder also uses, instead of an
+    // empty table. Must be called before the first block.
+    void load_profile(const HeaderList& entries) {
+        dyn_table.prefill(entries, size_update_pending ? pending_size : max_dynamic_size);
+    }
+
+    void end_block() {
+        if (metrics) {
+            count(METRIC_BLOCKS);
+            if (!block_start) {
+                count(METRIC_BYTES_OUT, output.size() - block_offset);
+                count(METRIC_BLOCK_NANOSECONDS, metric_clock() - block_time);
+            }
+        }
+        block_start = true;
+        if (memory_account) {
+            governor->report(*memory_account, dyn_table.size);
+        }
+    }
+
+    // Encodes a whole header block. A block that was recently encoded without
+    // changing the table (e.g. all fields indexed) is copied from the cache.
+    //
+    // Returns false for a block with a field HTTP/2 can't carry (see
+    // normalize_field()), which leaves the block incomplete.
+    bool pack_block(const HeaderList& headers) {
+        if (block_start && memory_account) {
+            update_table_size();
+        }
+        bool cacheable = block_start && !size_update_pending;
+        uint64_t generation = dyn_table.generation;
+        if (cacheable) {
+            uint64_t started = metrics ? metric_clock() : 0;
+            if (const string *bytes = block_cache.find(headers, generation)) {
+                debug("repeated block, %zu bytes from cache\n", bytes->size());
+                output += *bytes;
+                if (metrics) {
+                    // Only blocks and bytes: fields from the cache aren't
+                    // counted by kind.
+                    count(METRIC_BLOCKS);
+                    for (const Header& h : headers) {
+                        count(METRIC_BYTES_IN, h.first.size() + h.second.size());
+                    }
+                    count(METRIC_BYTES_OUT, bytes->size());
+                    count(METRIC_BLOCK_NANOSECONDS, metric_clock() - started);
+                }
+                return true;
+            }
+        }
+
+        size_t start = output.size();
+        for (const Header& h : headers) {
+            if (!pack(h.first, h.second)) {
+                return false;
+            }
+        }
+        if (cacheable && generation == dyn_table.generation) {
+            block_cache.insert(headers, output.substr(start), generation);
+        }
+        end_block();
+        return true;
+    }
+
+    bool pack(const string& name, const string& value) {
+        const string *n = normalize_field(name, value, lowercase_name);
+        if (!n) {
+            return false;
+        }
+        pack(HeaderTokens::get().find(*n), *n, value);
+        return true;
+    }
+
+    // With the token for the name known (e.g. from a decoder), so the name
+    // doesn't have to be looked up. The token must be the right one, and the
+    // field valid and lowercase.
+    void pack(HeaderToken token, const string& name, const string& value) {
+        const IndexPolicy index_policy = policy.get(token, name, value);
+        for_each_field(name, value, [this, token, index_policy](const string& name, const string& value) {
+            pack_field(token, name, value, index_policy);
+        });
+    }
+
+    unsigned max_table_size() const {
+        return max_dynamic_size;
+    }
+
+    const string& get_output() const {
+        return output;
+    }
+
+    void clear_output() {
+        output.clear();
+        block_offset = 0;
+    }
+
+    // Calls f for each field that pack() encodes for a header, i.e. each
+    // crumb of a cookie header when crumbling cookies.
+    template <typename T>
+    void for_each_field(const string& name, const string& value, T&& f) {
+        if (crumble_cookies && name == "cookie") {
+            // Only split on "; " so that the decoder's recombination gives
+            // back exactly the original value.
+            size_t start = 0;
+            size_t end;
+            while ((end = value.find("; ", start)) != string::npos) {
+                crumb.assign(value, start, end - start);
+                f(name, crumb);
+                start = end + 2;
+            }
+            crumb.assign(value, start, string::npos);
+            f(name, crumb);
+        } else {
+            f(name, value);
+        }
+    }
+
+    // Encodes a single field with the given policy rather than the one from
+    // the header policy. Oversized fields are still never indexed.
+    void pack_field(HeaderToken token, const string& name, const string& value, IndexPolicy index_policy) {
+        if (block_start) {
+            block_start = false;
+            if (metrics) {
+                block_offset = output.size();
+                block_time = metric_clock();
+            }
+            if (memory_account) {
+                update_table_size();
+            }
+            put_size_update();
+        }
+        count(METRIC_BYTES_IN, name.size() + value.size());
+
+        bool push = true;
+        size_t table_size = 32 + name.length() + value.length();
+        if (index_policy < NO_INDEX && table_size > uint64_t(max_dynamic_size) * max_entry_percent / 100) {
+            // Just avoid blowing away the dynamic table.
+            debug("oversized (%zu), non-indexed\n", table_size);
+            index_policy = NO_INDEX;
+        }
+
+        int i = 0;
+        if (index_policy != NEVER_INDEX && (i = dyn_table.find(token, name, value))) {
+            debug("index (both): %d\n", i);
+            tracepoint(HIT, TRACE_ENCODER, i, 0);
+            count(unsigned(i) < dynamic_table_start ? METRIC_STATIC_HITS : METRIC_DYNAMIC_HITS);
+            // References are never added to the table.
+            put_int(output, 0x80, 7, i);
+            return;
+        }
+
+        if (index_policy == INDEX && volatility.is_volatile(token, name)) {
+            debug("volatile, indexing name only\n");
+            index_policy = INDEX_NAME;
+        }
+        if (index_policy >= NO_INDEX
+                || (index_policy == INDEX_NAME && dyn_table.find(token, name))) {
+            // Sensitive => "literal header never indexed", intermediaries must
+            // not use indexed encoding for this.
+            // not sensitive => "literal header without indexing"
+            uint8_t sensitive = index_policy == NEVER_INDEX ? 0x10 : 0;
+            debug("%s, non-indexed\n", sensitive ? "sensitive" : "literal");
+            int name_ix = dyn_table.find(token, name);
+            if (name_ix) {
+                tracepoint(NAME_HIT, TRACE_ENCODER, name_ix, 0);
+                count(METRIC_NAME_HITS);
+                put_int(output, sensitive, 4, name_ix);
+            } else {
+                tracepoint(MISS, TRACE_ENCODER, 0, 0);
+                count(METRIC_LITERALS);
+                put8(output, sensitive);
+                count(METRIC_HUFFMAN_SAVED, put_string(output, name, huffman));
+            }
+            count(METRIC_HUFFMAN_SAVED, put_string(output, value, huffman));
+            push = false;
+        } else if ((i = dyn_table.find(token, name))) {
+            debug("index (name): %d\n", i);
+            tracepoint(NAME_HIT, TRACE_ENCODER, i, 0);
+            count(METRIC_NAME_HITS);
+            put_int(output, 0x40, 6, i);
+            count(METRIC_HUFFMAN_SAVED, put_string(output, value, huffman));
+        } else {
+            debug("literal\n");
+            tracepoint(MISS, TRACE_ENCODER, 0, 0);
+            count(METRIC_LITERALS);
+            put8(output, 0x40);
+            count(METRIC_HUFFMAN_SAVED, put_string(output, name, huffman));
+            count(METRIC_HUFFMAN_SAVED, put_string(output, value, huffman));
+        }
+        if (push) {
+            dyn_table.push(token, name, value);
+            tracepoint(INSERT, TRACE_ENCODER, table_size, dyn_table.size);
+            count(METRIC_INSERTS);
+            dyn_table.shrink(max_dynamic_size, [this](const TableEntry& e) {
+                evicted(e);
+            });
+            debug("adding to dyn table: %s = %s (size = %u)\n", name.c_str(), value.c_str(), dyn_table.size);
+        }
+    }
+
+private:
+    // Called before e is removed from the table
+    void evicted(const TableEntry& e) {
+        tracepoint(EVICT, TRACE_ENCODER, e.size(), dyn_table.size - e.size());
+        count(METRIC_EVICTIONS);
+        volatility.evicted(e);
+    }
+
+    void count(Metric m, uint64_t n = 1) {
+        if (metrics) {
+            metrics->add(m, n);
+        }
+    }
+
+    void update_table_size() {
+        unsigned size = std::min(wanted_table_size, settings_table_size);
+        if (memory_account) {
+            size = std::min(size, memory_account->limit.load(std::memory_order_relaxed));
+        }
+        unsigned current = size_update_pending ? pending_size : max_dynamic_size;
+        if (size == current) {
+            return;
+        }
+        if (size_update_pending) {
+            min_pending_size = std::min(min_pending_size, size);
+        } else {
+            min_pending_size = size;
+            size_update_pending = true;
+        }
+        pending_size = size;
+    }
+
+    void put_size_update() {
+        if (!size_update_pending) {
+            return;
+        }
+        size_update_pending = false;
+        auto evicted = [this](const TableEntry& e) {
+            this->evicted(e);
+        };
+        if (min_pending_size < pending_size) {
+            debug("size update (minimum): %u\n", min_pending_size);
+            tracepoint(SIZE_UPDATE, TRACE_ENCODER, min_pending_size, 0);
+            put_int(output, 0x20, 5, min_pending_size);
+            dyn_table.shrink(min_pending_size, evicted);
+        }
+        debug("size update: %u\n", pending_size);
+        tracepoint(SIZE_UPDATE, TRACE_ENCODER, pending_size, 0);
+        put_int(output, 0x20, 5, pending_size);
+        dyn_table.shrink(pending_size, evicted);
+        max_dynamic_size = pending_size;
+    }
+};
+
+} // namespace
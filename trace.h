@@ -0,0 +1,194 @@
+namespace {
+
+// A compact binary trace of header lists, for replaying traffic:
+//
+//   "HTRACE01"
+//   per block:  the number of fields
+//   per field:  0 and a new name (length and bytes), or n for the n-th new
+//               name in the trace; then the value (length and bytes)
+//
+// with all numbers as HPACK integers with an 8-bit prefix.
+const char TRACE_MAGIC[] = "HTRACE01";
+
+// Replaces values by random strings of the same length, so that a trace
+// keeps the sizes, Huffman-coded sizes and repetitions of the original
+// without its contents. Each digit or letter is replaced by one of the same
+// kind (digit, lowercase or uppercase) with a Huffman code of the same
+// length, the rest is kept. Equal values get equal replacements.
+class TraceAnonymizer {
+    map<string, string> replacements;
+    Random random;
+    string cookie;
+
+public:
+    explicit TraceAnonymizer(uint64_t seed): random(seed) {}
+
+    const string& anonymize(const string& name, const string& value) {
+        // These carry no data, and replacing them would lose static table
+        // matches.
+        if (name == ":method" || name == ":scheme" || name == ":status") {
+            return value;
+        }
+        if (name == "cookie") {
+            // Crumb by crumb, so that crumbs shared between cookie headers
+            // still are after crumbling.
+            cookie.clear();
+            size_t start = 0;
+            size_t end;
+            while ((end = value.find("; ", start)) != string::npos) {
+                cookie += replace(value.substr(start, end - start));
+                cookie += "; ";
+                start = end + 2;
+            }
+            cookie += replace(value.substr(start));
+            return cookie;
+        }
+        return replace(value);
+    }
+
+private:
+    // For each digit and letter, the characters it may be replaced by,
+    // itself included ('A' is the only 6-bit capital, so it's kept). Empty
+    // for everything else.
+    static const vector<string>& replacement_classes() {
+        static const vector<string> classes = []() {
+            vector<string> classes(256);
+            for (const char *kind : { "0123456789", "abcdefghijklmnopqrstuvwxyz", "ABCDEFGHIJKLMNOPQRSTUVWXYZ" }) {
+                for (const char *c = kind; *c; c++) {
+                    for (const char *r = kind; *r; r++) {
+                        if (huff_lengths[(uint8_t)*c] == huff_lengths[(uint8_t)*r]) {
+                            classes[(uint8_t)*c] += *r;
+                        }
+                    }
+                }
+            }
+            return classes;
+        }();
+        return classes;
+    }
+
+    const string& replace(const string& value) {
+        auto p = replacements.insert(std::make_pair(value, string()));
+        string& r = p.first->second;
+        if (p.second) {
+            r = value;
+            const vector<string>& classes = replacement_classes();
+            for (char& c : r) {
+                const string& choices = classes[(uint8_t)c];
+                if (!choices.empty()) {
+                    c = choices[random.next() % choices.size()];
+                }
+            }
+        }
+        return r;
+    }
+};
+
+class TraceWriter {
+    string output;
+    map<string, unsigned> names;
+
+public:
+    TraceWriter(): output(TRACE_MAGIC, 8) {}
+
+    void add(const HeaderList& headers) {
+        put_int(output, 0, 8, headers.size());
+        for (const Header& h : headers) {
+            auto p = names.insert(std::make_pair(h.first, names.size() + 1));
+            if (p.second) {
+                put_int(output, 0, 8, 0);
+                put_int(output, 0, 8, h.first.size());
+                output += h.first;
+            } else {
+                put_int(output, 0, 8, p.first->second);
+            }
+            put_int(output, 0, 8, h.second.size());
+            output += h.second;
+        }
+    }
+
+    const string& get_output() const {
+        return output;
+    }
+};
+
+// Reads a trace in place through mmap.
+class TraceReader {
+    MappedFile file;
+    const uint8_t *pos;
+    const uint8_t *end;
+    vector<string> names;
+
+    UnpackError get_length(unsigned& n) {
+        if (pos == end) {
+            return UNPACK_TRUNCATED;
+        }
+        uint8_t b1 = *pos++;
+        return get_int(b1, mask(8), pos, end, n);
+    }
+
+    UnpackError get_bytes(string& s) {
+        unsigned n;
+        if (UnpackError e = get_length(n)) {
+            return e;
+        }
+        if (n > (size_t)(end - pos)) {
+            return UNPACK_TRUNCATED;
+        }
+        s.assign((const char*)pos, n);
+        pos += n;
+        return UNPACK_OK;
+    }
+
+public:
+    TraceReader(): pos(nullptr), end(nullptr) {}
+
+    // Returns false if the file can't be read or isn't a trace.
+    bool open(const char *path) {
+        if (!file.open(path) || file.get_size() < 8 || memcmp(file.get_data(), TRACE_MAGIC, 8)) {
+            return false;
+        }
+        pos = file.get_data() + 8;
+        end = file.get_data() + file.get_size();
+        return true;
+    }
+
+    bool eof() const {
+        return pos == end;
+    }
+
+    // Reads the next block into headers, reusing its strings.
+    UnpackError read_block(HeaderList& headers) {
+        unsigned count;
+        if (UnpackError e = get_length(count)) {
+            return e;
+        }
+        // Each field takes at least two bytes.
+        if (count > (size_t)(end - pos) / 2) {
+            return UNPACK_TRUNCATED;
+        }
+        headers.resize(count);
+        for (Header& h : headers) {
+            unsigned ref;
+            if (UnpackError e = get_length(ref)) {
+                return e;
+            }
+            if (!ref) {
+                if (UnpackError e = get_bytes(h.first)) {
+                    return e;
+                }
+                names.push_back(h.first);
+            } else if (ref <= names.size()) {
+                h.first = names[ref - 1];
+            } else {
+                return UNPACK_INVALID_INDEX;
+            }
+            if (UnpackError e = get_bytes(h.second)) {
+                return e;
+            }
+        }
+        return UNPACK_OK;
+    }
+};
+
+} // namespace
@@ -0,0 +1,193 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#ifdef HPACK_USDT
+#include <sys/sdt.h>
+#endif
+
+namespace {
+
+// Table and coding events, for finding out what the codec does in a running
+// process rather than in a _debug build. Tracepoints are always compiled in,
+// and cost one predictable branch while tracing is off. When it's on, each
+// thread records events into its own ring buffer (no locks or shared cache
+// lines), and the last RING_SIZE events of each thread can be dumped at any
+// time.
+//
+// With -DHPACK_USDT=1, each tracepoint is also a USDT probe (provider hpack,
+// probe named after the event), which costs a nop when nothing is attached.
+enum TraceEvent {
+    // a: entry size, b: table size after the insert
+    TRACE_INSERT,
+    // a: entry size, b: table size after the eviction
+    TRACE_EVICT,
+    // Field found in the table. a: index
+    TRACE_HIT,
+    // Only the name found. a: index
+    TRACE_NAME_HIT,
+    // Name not found, sent as a literal
+    TRACE_MISS,
+    // a: length, b: Huffman-encoded length (Huffman is used if shorter)
+    TRACE_HUFFMAN,
+    // a: new table size
+    TRACE_SIZE_UPDATE,
+};
+
+enum TraceSide {
+    TRACE_ENCODER,
+    TRACE_DECODER,
+};
+
+struct TraceRecord {
+    uint64_t time; // steady_clock nanoseconds
+    unsigned thread;
+    TraceEvent event;
+    TraceSide side;
+    uint64_t a, b;
+};
+
+std::atomic<bool> tracepoints_enabled(false);
+
+class Tracepoints {
+    // One writer (the owning thread), any number of readers. Each slot has a
+    // sequence number that is odd while it's being written, so readers can
+    // tell a torn copy.
+    class Ring {
+        struct Slot {
+            std::atomic<uint64_t> seq;
+            std::atomic<uint64_t> time, a, b;
+            std::atomic<unsigned> event;
+        };
+
+    public:
+        static const size_t RING_SIZE = 4096;
+
+        Slot slots[RING_SIZE];
+        std::atomic<uint64_t> head;
+        std::atomic<bool> in_use;
+        const unsigned thread;
+
+        explicit Ring(unsigned thread): head(0), in_use(true), thread(thread) {
+            for (Slot& s : slots) {
+                s.seq.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void push(uint64_t time, unsigned event, uint64_t a, uint64_t b) {
+            uint64_t i = head.load(std::memory_order_relaxed);
+            Slot& s = slots[i % RING_SIZE];
+            s.seq.store(2 * i + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            s.time.store(time, std::memory_order_relaxed);
+            s.event.store(event, std::memory_order_relaxed);
+            s.a.store(a, std::memory_order_relaxed);
+            s.b.store(b, std::memory_order_relaxed);
+            s.seq.store(2 * i + 2, std::memory_order_release);
+            head.store(i + 1, std::memory_order_release);
+        }
+
+        void read(vector<TraceRecord>& out) const {
+            uint64_t end = head.load(std::memory_order_acquire);
+            uint64_t start = end > RING_SIZE ? end - RING_SIZE : 0;
+            for (uint64_t i = start; i < end; i++) {
+                const Slot& s = slots[i % RING_SIZE];
+                uint64_t seq = s.seq.load(std::memory_order_acquire);
+                unsigned event = s.event.load(std::memory_order_relaxed);
+                TraceRecord r = { s.time.load(std::memory_order_relaxed), thread,
+                    TraceEvent(event >> 1), TraceSide(event & 1),
+                    s.a.load(std::memory_order_relaxed), s.b.load(std::memory_order_relaxed) };
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq == 2 * i + 2 && s.seq.load(std::memory_order_relaxed) == seq) {
+                    out.push_back(r);
+                }
+            }
+        }
+    };
+
+    // Gives the ring back when its thread exits, for the next new thread.
+    struct RingHolder {
+        Ring *ring;
+
+        RingHolder(): ring(Tracepoints::get().take_ring()) {}
+
+        ~RingHolder() {
+            ring->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    std::mutex lock;
+    vector<std::unique_ptr<Ring>> rings;
+
+    Ring *take_ring() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& r : rings) {
+            bool free = false;
+            if (r->in_use.compare_exchange_strong(free, true)) {
+                return r.get();
+            }
+        }
+        rings.emplace_back(new Ring(rings.size()));
+        return rings.back().get();
+    }
+
+public:
+    static Tracepoints& get() {
+        static Tracepoints tracepoints;
+        return tracepoints;
+    }
+
+    static void enable(bool on) {
+        // Constructed now, so that it outlives anything registered with
+        // atexit after this, like a dump of the trace.
+        get();
+        tracepoints_enabled.store(on, std::memory_order_relaxed);
+    }
+
+    // Only called with tracing on, through tracepoint().
+    static void record(TraceEvent event, TraceSide side, uint64_t a, uint64_t b) {
+        static thread_local RingHolder holder;
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        holder.ring->push(now, event << 1 | side, a, b);
+    }
+
+    // The events still in the rings, by thread and oldest first. Threads
+    // keep recording meanwhile.
+    vector<TraceRecord> snapshot() {
+        vector<TraceRecord> records;
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& r : rings) {
+            r->read(records);
+        }
+        return records;
+    }
+
+    void dump(FILE *fp) {
+        static const char *const events[] = {
+            "insert", "evict", "hit", "name_hit", "miss", "huffman", "size_update",
+        };
+        for (const TraceRecord& r : snapshot()) {
+            fprintf(fp, "%llu %u %s %s %llu %llu\n", (unsigned long long)r.time, r.thread,
+                    r.side == TRACE_ENCODER ? "encoder" : "decoder", events[r.event],
+                    (unsigned long long)r.a, (unsigned long long)r.b);
+        }
+    }
+};
+
+} // namespace
+
+#ifdef HPACK_USDT
+#define TRACEPOINT_PROBE(event, side, a, b) DTRACE_PROBE3(hpack, event, side, a, b)
+#else
+#define TRACEPOINT_PROBE(event, side, a, b) (void)0
+#endif
+
+// tracepoint(INSERT, TRACE_ENCODER, entry_size, table_size)
+#define tracepoint(event, side, a, b) do { \
+    TRACEPOINT_PROBE(event, side, a, b); \
+    if (__builtin_expect(tracepoints_enabled.load(std::memory_order_relaxed), 0)) { \
+        Tracepoints::record(TRACE_##event, side, a, b); \
+    } \
+} while (0)
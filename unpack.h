@@ -1,167 +1,689 @@
 namespace {
+// The entry whose code is a prefix of code. The code is complete, so there
+// always is one (EOS, which isn't in the table, is handled by the caller).
 const HuffTableEntry* find_code(uint32_t code)
 {
     const HuffTableEntry* const start = huff_decode_table;
     const HuffTableEntry* const end = start + 256;
     const HuffTableEntry* res = std::lower_bound(start, end, code);
-    if (res->msb_code > code) {
-        assert(res > start);
+    // Codes above the last entry belong to it.
+    if (res == end || res->msb_code > code) {
         res--;
     }
     return res;
 }
 
-string decode_huffman(string input)
+unsigned mask(unsigned bits)
 {
-    unsigned min_bits = 30;
-    unsigned bits = 0;
+    return (1 << bits) - 1;
+}
+
+enum UnpackError {
+    UNPACK_OK,
+    // The decoded header list is larger than SETTINGS_MAX_HEADER_LIST_SIZE.
+    UNPACK_HEADER_LIST_TOO_LARGE,
+    // The block decoded to much more than its own size, e.g. by referencing
+    // a large table entry over and over.
+    UNPACK_EXPANSION_TOO_LARGE,
+    // The block ends in the middle of a field.
+    UNPACK_TRUNCATED,
+    // An integer doesn't fit in 28 bits.
+    UNPACK_INTEGER_OVERFLOW,
+    // A reference to an entry that isn't in the table.
+    UNPACK_INVALID_INDEX,
+    // A table size update above the size allowed in SETTINGS.
+    UNPACK_INVALID_TABLE_SIZE,
+    // A name that is empty, has uppercase letters or NUL, CR or LF.
+    UNPACK_INVALID_HEADER_NAME,
+    // A value with NUL, CR or LF.
+    UNPACK_INVALID_HEADER_VALUE,
+    // A Huffman-coded string with EOS in it, or padding that is longer
+    // than 7 bits or not all ones.
+    UNPACK_INVALID_HUFFMAN,
+    // Pseudo-headers that don't make an HTTP/1.1 request or status line
+    // (only from unpack_http1, the table is still usable).
+    UNPACK_INVALID_PSEUDO_HEADER,
+};
+
+inline const char *unpack_error_string(UnpackError error)
+{
+    switch (error) {
+    case UNPACK_OK: return "no error";
+    case UNPACK_HEADER_LIST_TOO_LARGE: return "header list too large";
+    case UNPACK_EXPANSION_TOO_LARGE: return "header block expands too much";
+    case UNPACK_TRUNCATED: return "truncated header block";
+    case UNPACK_INTEGER_OVERFLOW: return "integer overflow";
+    case UNPACK_INVALID_INDEX: return "invalid table index";
+    case UNPACK_INVALID_TABLE_SIZE: return "invalid table size update";
+    case UNPACK_INVALID_HEADER_NAME: return "invalid header name";
+    case UNPACK_INVALID_HEADER_VALUE: return "invalid header value";
+    case UNPACK_INVALID_HUFFMAN: return "invalid Huffman code";
+    case UNPACK_INVALID_PSEUDO_HEADER: return "invalid pseudo-header";
+    }
+    return "unknown error";
+}
+
+// Integers are limited to 28 bits (four continuation bytes), which is more
+// than any table size, index or string length we can handle.
+const unsigned MAX_INT_CONTINUATION = 4;
+
+// Decodes an integer with an N-bit prefix into val. The one and two byte
+// forms cover nearly all indices and lengths, so they are checked first.
+UnpackError get_int(uint8_t byte1, unsigned b1_mask, const uint8_t*& pos, const uint8_t* const end, unsigned& val)
+{
+    val = byte1 & b1_mask;
+    if (val < b1_mask) {
+        return UNPACK_OK;
+    }
+    if (pos < end && !(*pos & 0x80)) {
+        val += *pos++;
+        return UNPACK_OK;
+    }
+
+    unsigned v = 0;
+    for (unsigned i = 0; i < MAX_INT_CONTINUATION; i++) {
+        if (pos == end) {
+            return UNPACK_TRUNCATED;
+        }
+        uint8_t b = *pos++;
+        v |= (unsigned)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            val += v;
+            return UNPACK_OK;
+        }
+    }
+    return UNPACK_INTEGER_OVERFLOW;
+}
+
+// Appends the decoded string to res. Stops with an error once more than
+// max_length bytes have been appended, without decoding the rest.
+UnpackError decode_huffman(const char *input, size_t length, string& res, size_t max_length = SIZE_MAX)
+{
+    const size_t limit = res.size() + std::min(max_length, SIZE_MAX - res.size());
+    // The next bits of input, MSB-aligned, and how many there are
     uint64_t n = 0;
-    const uint8_t *pos = (const uint8_t*)input.c_str();
-    const uint8_t *const end = pos + input.length();
-    string res;
-
-    // Hurr. Durr.
-    while (bits || pos < end) {
-        while (bits < min_bits) {
-            uint8_t b1 = 0xff;
-            if (pos < end) {
-                b1 = *pos++;
-            }
-            assert(bits + 8 <= 64);
+    unsigned bits = 0;
+    const uint8_t *pos = (const uint8_t*)input;
+    const uint8_t *const end = pos + length;
+
+    for (;;) {
+        while (bits <= 56 && pos < end) {
+            n |= (uint64_t)*pos++ << (56 - bits);
             bits += 8;
-            n |= (uint64_t)b1 << (64 - bits);
-            //debug("read %#x, have %u bits in %#lx\n", b1, bits, n);
         }
+        if (!bits) {
+            break;
+        }
+        // Filled up with ones, so that padding looks like the start of EOS
         uint32_t code = n >> 32;
-        // EOS
+        if (bits < 32) {
+            code |= 0xffffffff >> bits;
+        }
+        // EOS, or the padding at the end, which is the start of EOS
         if (code >= 0xfffffffc) {
+            if (bits > 7) {
+                debug("huffman: EOS or %u bits of padding\n", bits);
+                return UNPACK_INVALID_HUFFMAN;
+            }
             break;
         }
-        //debug("have %u bits in %#lx (%#x)\n", bits, n, code);
-        const HuffTableEntry* p = find_code(n >> 32);
-        assert(p);
+        const HuffTableEntry* p = find_code(code);
         unsigned len = huff_lengths[p->value];
-        uint32_t shifted_code = code >> (32 - len);
-        debug("found code %#x (%u bits, %#x, %#x), char %#x '%c'\n", p->msb_code, len, p->msb_code >> (32 - len), shifted_code, p->value, p->value);
-        assert(shifted_code == (p->msb_code >> (32 - len)));
+        if (len > bits) {
+            // Padding that isn't all ones
+            debug("huffman: invalid padding\n");
+            return UNPACK_INVALID_HUFFMAN;
+        }
+        debug("found code %#x (%u bits), char %#x '%c'\n", p->msb_code, len, p->value, p->value);
         n <<= len;
         bits -= len;
+        if (res.size() == limit) {
+            debug("huffman: more than %zu bytes\n", max_length);
+            return UNPACK_HEADER_LIST_TOO_LARGE;
+        }
         res += (char)p->value;
     }
 
     debug("huffman-decoded: %s\n", res.c_str());
-
-    return res;
+    return UNPACK_OK;
 }
 
-unsigned mask(unsigned bits)
-{
-    return (1 << bits) - 1;
-}
+// Huffman-decoded strings, keyed by their encoded bytes. Peers tend to send
+// the same literals over and over without indexing them (tokens, cookies, user
+// agents), and copying a decoded string is much cheaper than decoding it.
+//
+// Every connection has one, so it's kept small: the strings it holds add up
+// to at most MAX_BYTES, about the size of a default dynamic table. A string
+// that doesn't fit replaces nothing and is simply not cached.
+class HuffmanCache {
+    struct Slot {
+        string encoded, decoded;
+    };
 
-unsigned get_int(uint8_t byte1, unsigned b1_mask, const uint8_t*& pos, const uint8_t* const end)
-{
-    unsigned val = byte1 & b1_mask;
-    if (val < b1_mask) {
-        return val;
-    }
+    // Direct-mapped. Shorter strings decode about as fast as they're looked
+    // up.
+    static const size_t SLOTS = 64;
+    static const size_t MIN_LENGTH = 8;
+    static const size_t MAX_BYTES = 4096;
+    Slot slots[SLOTS];
+    // Encoded plus decoded bytes of all slots
+    size_t bytes_used;
 
-    unsigned bitpos = 0;
-    val = 0;
-    while (pos < end) {
-        uint8_t b = *pos++;
-        val |= (b & 0x7f) << bitpos;
-        bitpos += 7;
-        if (!(b & 0x80)) {
-            break;
+public:
+    size_t hits, misses;
+
+    HuffmanCache(): bytes_used(0), hits(0), misses(0) {}
+
+    // Strings longer than max_length fail as in decode_huffman(), but a
+    // cached one is returned whatever its length.
+    UnpackError decode(const char *start, size_t length, string& out, size_t max_length = SIZE_MAX) {
+        out.clear();
+        if (length < MIN_LENGTH) {
+            return decode_huffman(start, length, out, max_length);
+        }
+        Slot& slot = slots[hash_bytes(start, length) % SLOTS];
+        if (!slot.encoded.compare(0, string::npos, start, length)) {
+            hits++;
+            debug("huffman cache hit: %s\n", slot.decoded.c_str());
+            out = slot.decoded;
+            return UNPACK_OK;
+        }
+        misses++;
+        if (UnpackError e = decode_huffman(start, length, out, max_length)) {
+            return e;
         }
+        // The old strings' memory is released, not kept for reuse, so that
+        // the bytes counted are the bytes held.
+        bytes_used -= slot.encoded.size() + slot.decoded.size();
+        string().swap(slot.encoded);
+        string().swap(slot.decoded);
+        if (bytes_used + length + out.size() <= MAX_BYTES) {
+            slot.encoded.assign(start, length);
+            slot.decoded = out;
+            bytes_used += length + out.size();
+        }
+        return UNPACK_OK;
     }
-    return val + b1_mask;
-}
+};
 
-string get_string(const uint8_t*& pos, const uint8_t* const end)
+// Decodes a string into out, reusing its buffer. A string that decodes to
+// more than max_length bytes is rejected before or while it's decoded.
+UnpackError get_string(const uint8_t*& pos, const uint8_t* const end, HuffmanCache& cache, string& out,
+        size_t max_length = SIZE_MAX)
 {
-    assert(pos < end);
+    if (pos == end) {
+        return UNPACK_TRUNCATED;
+    }
     uint8_t b1 = *pos++;
-    unsigned length = get_int(b1, mask(7), pos, end);
+    unsigned length;
+    if (UnpackError e = get_int(b1, mask(7), pos, end, length)) {
+        return e;
+    }
+    if (length > (size_t)(end - pos)) {
+        return UNPACK_TRUNCATED;
+    }
+    // Huffman codes are at most 30 bits long.
+    if ((b1 & 0x80 ? length * 8 / 30 : length) > max_length) {
+        debug("string of %u bytes, %zu allowed\n", length, max_length);
+        return UNPACK_HEADER_LIST_TOO_LARGE;
+    }
     const char *start = (const char*)pos;
     pos += length;
-    assert(pos <= end);
-    string s(start, (const char*)pos);
     if (b1 & 0x80) {
-        return decode_huffman(s);
-    } else {
-        debug("plain string: %s\n", s.c_str());
-        return s;
+        return cache.decode(start, length, out, max_length);
     }
+    out.assign(start, length);
+    debug("plain string: %s\n", out.c_str());
+    return UNPACK_OK;
 }
 
+// Reads a frame of batch output (see put_frame() in batch.h): the
+// connection id and the header block, which points into the input.
+inline UnpackError get_frame(const uint8_t*& pos, const uint8_t* const end,
+        string& connection, const uint8_t*& block, size_t& length)
+{
+    unsigned n;
+    if (pos == end) {
+        return UNPACK_TRUNCATED;
+    }
+    uint8_t b1 = *pos++;
+    if (UnpackError e = get_int(b1, mask(8), pos, end, n)) {
+        return e;
+    }
+    if (n >= (size_t)(end - pos)) {
+        return UNPACK_TRUNCATED;
+    }
+    connection.assign((const char*)pos, n);
+    pos += n;
+    b1 = *pos++;
+    if (UnpackError e = get_int(b1, mask(8), pos, end, n)) {
+        return e;
+    }
+    if (n > (size_t)(end - pos)) {
+        return UNPACK_TRUNCATED;
+    }
+    block = pos;
+    length = n;
+    pos += n;
+    return UNPACK_OK;
+}
+
+// All headers of a block, with the strings stored one after the other in a
+// single buffer. Reusing the same block for the next unpack keeps the
+// buffers, so decoding doesn't need to allocate anything per header.
+struct FlatHeader {
+    HeaderToken token;
+    uint32_t name_offset, name_length;
+    uint32_t value_offset, value_length;
+};
+
+struct FlatHeaderBlock {
+    string arena;
+    vector<FlatHeader> fields;
+
+    void clear() {
+        arena.clear();
+        fields.clear();
+    }
+
+    const char *name(const FlatHeader& f) const {
+        return arena.data() + f.name_offset;
+    }
+
+    const char *value(const FlatHeader& f) const {
+        return arena.data() + f.value_offset;
+    }
+};
+
+struct DecodedHeader {
+    HeaderToken token;
+    string name, value;
+};
+typedef vector<DecodedHeader> DecodedHeaderList;
+
+// Writes a header block as an HTTP/1.1 message head, straight into an output
+// buffer: the pseudo-headers become the request line (and :authority the
+// host header) or the status line, the other fields "name: value" lines.
+//
+// Pseudo-headers come before all other fields, so only they are held back
+// until the first line can be written.
+class Http1Writer {
+    const HeaderToken method_token, scheme_token, authority_token, path_token, status_token;
+    string method, scheme, authority, path, status;
+    bool have_method, have_scheme, have_authority, have_path, have_status;
+    bool started;
+    UnpackError error;
+
+public:
+    Http1Writer(): method_token(HeaderTokens::get().find(":method")),
+        scheme_token(HeaderTokens::get().find(":scheme")),
+        authority_token(HeaderTokens::get().find(":authority")),
+        path_token(HeaderTokens::get().find(":path")),
+        status_token(HeaderTokens::get().find(":status")) {
+        reset();
+    }
+
+    void reset() {
+        have_method = have_scheme = have_authority = have_path = have_status = false;
+        started = false;
+        error = UNPACK_OK;
+    }
+
+    void add(HeaderToken token, const string& name, const string& value, string& out) {
+        if (name[0] != ':') {
+            start(out);
+            out += name;
+            out += ": ";
+            out += value;
+            out += "\r\n";
+            return;
+        }
+        // Each pseudo-header at most once (RFC 7540 section 8.1.2.3)
+        if (started) {
+            error = UNPACK_INVALID_PSEUDO_HEADER;
+        } else if (token == method_token) {
+            set(method, have_method, value);
+        } else if (token == scheme_token) {
+            set(scheme, have_scheme, value);
+        } else if (token == authority_token) {
+            set(authority, have_authority, value);
+        } else if (token == path_token) {
+            set(path, have_path, value);
+        } else if (token == status_token) {
+            set(status, have_status, value);
+        } else {
+            error = UNPACK_INVALID_PSEUDO_HEADER;
+        }
+    }
+
+    UnpackError finish(string& out) {
+        start(out);
+        out += "\r\n";
+        return error;
+    }
+
+private:
+    void set(string& field, bool& have, const string& value) {
+        if (have) {
+            error = UNPACK_INVALID_PSEUDO_HEADER;
+        }
+        field = value;
+        have = true;
+    }
+
+    void start(string& out) {
+        if (started) {
+            return;
+        }
+        started = true;
+        // CONNECT has no :path, the target is the authority. Every other
+        // request needs a :path.
+        const bool connect = have_method && method == "CONNECT";
+        if (have_method == have_status || (have_method && (connect ? !have_authority : !have_path))) {
+            error = UNPACK_INVALID_PSEUDO_HEADER;
+        } else if (have_status) {
+            // No reason phrase, it may be empty.
+            out += "HTTP/1.1 ";
+            out += status;
+            out += " \r\n";
+        } else {
+            out += method;
+            out += ' ';
+            out += connect ? authority : path;
+            out += " HTTP/1.1\r\n";
+            if (have_authority) {
+                out += "host: ";
+                out += authority;
+                out += "\r\n";
+            }
+        }
+    }
+};
+
 class UnpackState {
     string buffer;
     DynamicTable dyn_table;
     unsigned max_dynamic_size;
+    HeaderToken token;
     string name, value;
+    // Crumbs of the cookie header seen so far in the block, joined with "; ".
+    const HeaderToken cookie_token;
+    string cookie;
+    bool have_cookie;
+
+    BlockCache<string, DecodedHeaderList> block_cache;
+    HuffmanCache huffman_cache;
+    // Fields of the current block, while it still hasn't changed the table.
+    // Strings are reused between blocks, so only the first size fields are
+    // valid.
+    DecodedHeaderList recorded;
+    size_t recorded_size;
+
+    TableMemoryGovernor *governor;
+    TableMemoryGovernor::AccountPtr memory_account;
+
+    CodecMetrics *codec_metrics;
+    CodecMetrics::CountersPtr metrics;
+
+    // SETTINGS_HEADER_TABLE_SIZE, the largest table size the encoder may
+    // ask for
+    unsigned settings_table_size;
+
+    // Size of the current block as counted for SETTINGS_MAX_HEADER_LIST_SIZE
+    size_t header_list_size;
+    // After an error, the table may be out of sync with the encoder, so the
+    // connection is unusable.
+    UnpackError error;
+
+    Http1Writer http1;
+
+    // Only through fork(), so that copies get their own accounts.
+    UnpackState(const UnpackState&) = default;
+    UnpackState& operator=(const UnpackState&) = delete;
 
 public:
-    UnpackState(): max_dynamic_size(4096) {}
+    // SETTINGS_MAX_HEADER_LIST_SIZE, 0 for unlimited. Counted like the table
+    // size, i.e. 32 bytes plus name and value for each field.
+    size_t max_header_list_size;
+    // Blocks that decode to more than this many bytes (counted like the
+    // header list size) per input byte fail, once they're larger than
+    // MIN_EXPANSION_CHECK_SIZE. 0 (the default) for unlimited: a stream
+    // that reuses its table a lot legitimately expands more than 100 times.
+    unsigned max_expansion_ratio;
+    static const size_t MIN_EXPANSION_CHECK_SIZE = 65536;
+
+    // Concatenate all cookie headers (crumbs) of a block into one, as
+    // required by RFC 7540 section 8.1.2.5 before passing them on to
+    // HTTP/1.1. The combined cookie comes after the block's other fields.
+    bool combine_cookies;
+
+    UnpackState(): max_dynamic_size(4096), token(NO_TOKEN),
+        cookie_token(HeaderTokens::get().find("cookie")), have_cookie(false),
+        recorded_size(0), governor(nullptr), codec_metrics(nullptr), settings_table_size(4096), header_list_size(0), error(UNPACK_OK),
+        max_header_list_size(0), max_expansion_ratio(0), combine_cookies(false) {}
+
+    // Start from the same table profile as the encoder.
+    void load_profile(const HeaderList& entries) {
+        dyn_table.prefill(entries, max_dynamic_size);
+    }
+
+    // Account for the table's memory in the governor. Decoder tables can't
+    // be shrunk from here, but count towards the budget.
+    void use_memory_governor(TableMemoryGovernor& g) {
+        governor = &g;
+        memory_account = g.open(false);
+    }
+
+    UnpackState(UnpackState&&) = default;
+
+    // Count what the decoder does in m, see metrics.h.
+    void use_metrics(CodecMetrics& m) {
+        codec_metrics = &m;
+        metrics = m.open(false);
+    }
+
+    // A copy of this state (settings, limits and table) for another
+    // connection, with its own memory account and metrics.
+    UnpackState fork() const {
+        UnpackState state = *this;
+        if (governor) {
+            state.use_memory_governor(*governor);
+        }
+        if (codec_metrics) {
+            state.use_metrics(*codec_metrics);
+        }
+        return state;
+    }
+
+    // The table size we advertised in SETTINGS. The table itself only
+    // changes size when the encoder sends an update.
+    void set_settings_table_size(unsigned size) {
+        settings_table_size = size;
+    }
 
     void feed(const string& data) {
         buffer += data;
     }
 
+    // Decodes the buffered data as one header block, calling
+    // callback(name, value) for each header.
+    //
+    // Decoding stops at the first error, which makes the state unusable.
+    template <typename T>
+    UnpackError unpack(T&& callback) {
+        return unpack_tokens([&](HeaderToken, const string& name, const string& value) {
+            callback(name, value);
+        });
+    }
+
+    // Decodes the buffered data as one header block into block.
+    UnpackError unpack_flat(FlatHeaderBlock& block) {
+        block.clear();
+        return unpack_tokens([&block](HeaderToken token, const string& name, const string& value) {
+            FlatHeader f;
+            f.token = token;
+            f.name_offset = block.arena.size();
+            f.name_length = name.size();
+            block.arena += name;
+            f.value_offset = block.arena.size();
+            f.value_length = value.size();
+            block.arena += value;
+            block.fields.push_back(f);
+        });
+    }
+
+    // Decodes the buffered data as one header block and appends it to out as
+    // an HTTP/1.1 request or response head, ending with the empty line.
+    // Cookies are always combined, HTTP/1.1 only allows one cookie header.
+    UnpackError unpack_http1(string& out) {
+        http1.reset();
+        bool combine = combine_cookies;
+        combine_cookies = true;
+        UnpackError e = unpack_tokens([this, &out](HeaderToken token, const string& name, const string& value) {
+            http1.add(token, name, value, out);
+        });
+        combine_cookies = combine;
+        return e ? e : http1.finish(out);
+    }
+
+    // Like unpack, but calls callback(token, name, value), with the token
+    // from HeaderTokens for the name.
+    //
+    // A block with the same bytes as a recent one that didn't change the
+    // table is replayed from the cache.
     template <typename T>
-    void unpack(T&& callback) {
+    UnpackError unpack_tokens(T&& callback) {
+        if (error) {
+            buffer.clear();
+            return error;
+        }
+        header_list_size = 0;
+        const uint64_t started = metrics ? metric_clock() : 0;
+
+        const uint64_t generation = dyn_table.generation;
+        if (const DecodedHeaderList *headers = block_cache.find(buffer, generation)) {
+            debug("repeated block, %zu headers from cache\n", headers->size());
+            for (const DecodedHeader& h : *headers) {
+                if (check_limits(h.name, h.value)) {
+                    return fail();
+                }
+                emit(h.token, h.name, h.value, callback);
+            }
+            flush_cookie(callback);
+            // Fields from the cache aren't counted by kind.
+            count_block(started);
+            buffer.clear();
+            return UNPACK_OK;
+        }
+
+        bool recording = true;
+        recorded_size = 0;
         const uint8_t *pos = (const uint8_t*)buffer.c_str();
         const uint8_t *const input_end = pos + buffer.length();
         while (pos < input_end) {
             bool push = true;
-            int name_ix = 0;
-            int both_ix = 0;
+            unsigned name_ix = 0;
+            unsigned both_ix = 0;
 
             uint8_t b1 = *pos++;
             if (b1 & 0x80) {
-                both_ix = get_int(b1, mask(7), pos, input_end);
-                debug("indexed (both): %d\n", name_ix);
+                error = get_int(b1, mask(7), pos, input_end, both_ix);
+                debug("indexed (both): %u\n", both_ix);
+                if (!error && !both_ix) {
+                    error = UNPACK_INVALID_INDEX;
+                }
                 push = false;
             } else if (b1 & 0x40) {
-                name_ix = get_int(b1, mask(6), pos, input_end);
-                debug("indexed (name): %d\n", name_ix);
+                error = get_int(b1, mask(6), pos, input_end, name_ix);
+                debug("indexed (name): %u\n", name_ix);
             } else if (b1 & 0x20) {
-                max_dynamic_size = get_int(b1, mask(5), pos, input_end);
+                unsigned new_size;
+                if ((error = get_int(b1, mask(5), pos, input_end, new_size))) {
+                    return fail();
+                }
+                if (new_size > settings_table_size) {
+                    error = UNPACK_INVALID_TABLE_SIZE;
+                    return fail();
+                }
+                max_dynamic_size = new_size;
                 debug("changed dynamic table size: %u\n", max_dynamic_size);
-                dyn_table.shrink(max_dynamic_size);
+                tracepoint(SIZE_UPDATE, TRACE_DECODER, max_dynamic_size, 0);
+                shrink_table();
+                recording = false;
                 continue;
             } else {
                 // 0000xxxx or 0001xxxx, with x = 0 for name not indexed
                 // Both are unindexed
                 push = false;
-                name_ix = get_int(b1, mask(4), pos, input_end);
-                debug("unindexed (name): %d\n", name_ix);
+                error = get_int(b1, mask(4), pos, input_end, name_ix);
+                debug("unindexed (name): %u\n", name_ix);
+            }
+            if (error) {
+                return fail();
             }
 
+            unsigned ix = both_ix ? both_ix : name_ix;
+            if (ix && !dyn_table.valid_index(ix)) {
+                error = UNPACK_INVALID_INDEX;
+                return fail();
+            }
             if (both_ix) {
+                tracepoint(HIT, TRACE_DECODER, both_ix, 0);
+                count(both_ix < dynamic_table_start ? METRIC_STATIC_HITS : METRIC_DYNAMIC_HITS);
                 const TableEntry& e = dyn_table.get(both_ix);
+                token = e.token;
                 name = e.name;
                 value = e.value;
             } else if (name_ix) {
+                tracepoint(NAME_HIT, TRACE_DECODER, name_ix, 0);
+                count(METRIC_NAME_HITS);
+                token = dyn_table.get_token(name_ix);
                 name = dyn_table.get_name(name_ix);
-                value = get_string(pos, input_end);
+                if (!(error = get_string(pos, input_end, huffman_cache, value, string_budget(name.size())))) {
+                    error = check_value(value);
+                }
             } else {
-                name = get_string(pos, input_end);
-                value = get_string(pos, input_end);
+                tracepoint(MISS, TRACE_DECODER, 0, 0);
+                count(METRIC_LITERALS);
+                if (!(error = get_string(pos, input_end, huffman_cache, name, string_budget(0)))
+                        && !(error = check_name(name))
+                        && !(error = get_string(pos, input_end, huffman_cache, value, string_budget(name.size())))) {
+                    error = check_value(value);
+                    token = HeaderTokens::get().find(name);
+                }
+            }
+            if (error) {
+                return fail();
             }
 
-            callback(name, value);
+            if (check_limits(name, value)) {
+                return fail();
+            }
+            emit(token, name, value, callback);
 
             if (push) {
-                dyn_table.push(name, value);
-                // dyn_table.shrink(max_dynamic_size);
+                dyn_table.push(token, name, value);
+                tracepoint(INSERT, TRACE_DECODER, 32 + name.size() + value.size(), dyn_table.size);
+                count(METRIC_INSERTS);
+                shrink_table();
                 debug("adding to dyn table: %s = %s (size = %u)\n",
                         name.c_str(), value.c_str(), dyn_table.size);
+                recording = false;
+            } else if (recording) {
+                record(token, name, value);
             }
         }
-        assert(pos == input_end);
+        flush_cookie(callback);
+        if (recording && generation == dyn_table.generation) {
+            recorded.resize(recorded_size);
+            block_cache.insert(buffer, recorded, generation);
+        }
+        if (memory_account) {
+            governor->report(*memory_account, dyn_table.size);
+        }
+        count_block(started);
         buffer.clear();
+        return UNPACK_OK;
     }
 
     void eof() {
@@ -171,6 +693,114 @@ public:
     bool has_buffer() const {
         return buffer.size() > 0;
     }
+
+    const HuffmanCache& get_huffman_cache() const {
+        return huffman_cache;
+    }
+
+private:
+    void shrink_table() {
+        dyn_table.shrink(max_dynamic_size, [this](const TableEntry& e) {
+            tracepoint(EVICT, TRACE_DECODER, e.size(), dyn_table.size - e.size());
+            count(METRIC_EVICTIONS);
+        });
+    }
+
+    void count(Metric m, uint64_t n = 1) {
+        if (metrics) {
+            metrics->add(m, n);
+        }
+    }
+
+    // Header bytes out are counted per field, in check_limits().
+    void count_block(uint64_t started) {
+        if (metrics) {
+            count(METRIC_BLOCKS);
+            count(METRIC_BYTES_IN, buffer.size());
+            count(METRIC_BLOCK_NANOSECONDS, metric_clock() - started);
+        }
+    }
+
+    // Only literals are checked: everything in the table was checked on the
+    // way in.
+    static UnpackError check_name(const string& name) {
+        return name.empty() || check_field(name) ? UNPACK_INVALID_HEADER_NAME : UNPACK_OK;
+    }
+
+    static UnpackError check_value(const string& value) {
+        return check_field(value) & FIELD_FORBIDDEN ? UNPACK_INVALID_HEADER_VALUE : UNPACK_OK;
+    }
+
+    // The most a string of a field may decode to without exceeding
+    // max_header_list_size, given the other string's length.
+    size_t string_budget(size_t other_length) const {
+        if (!max_header_list_size) {
+            return SIZE_MAX;
+        }
+        const size_t used = header_list_size + 32 + other_length;
+        return used < max_header_list_size ? max_header_list_size - used : 0;
+    }
+
+    UnpackError check_limits(const string& name, const string& value) {
+        header_list_size += 32 + name.length() + value.length();
+        count(METRIC_BYTES_OUT, name.length() + value.length());
+        if (max_header_list_size && header_list_size > max_header_list_size) {
+            error = UNPACK_HEADER_LIST_TOO_LARGE;
+        } else if (max_expansion_ratio && header_list_size > MIN_EXPANSION_CHECK_SIZE
+                && header_list_size / max_expansion_ratio > buffer.size()) {
+            error = UNPACK_EXPANSION_TOO_LARGE;
+        }
+        if (error) {
+            debug("%s after %zu bytes (%zu bytes of input)\n",
+                    unpack_error_string(error), header_list_size, buffer.size());
+        }
+        return error;
+    }
+
+    UnpackError fail() {
+        // Drop any combined cookie, the rest of the block won't be seen.
+        cookie.clear();
+        have_cookie = false;
+        buffer.clear();
+        return error;
+    }
+
+    template <typename T>
+    void emit(HeaderToken token, const string& name, const string& value, T&& callback) {
+        if (combine_cookies && token == cookie_token) {
+            // The buffer keeps its capacity between blocks, so a
+            // recombined cookie usually costs no allocations at all.
+            if (have_cookie) {
+                cookie += "; ";
+            }
+            cookie += value;
+            have_cookie = true;
+        } else {
+            callback(token, name, value);
+        }
+    }
+
+    void record(HeaderToken token, const string& name, const string& value) {
+        if (recorded_size < recorded.size()) {
+            DecodedHeader& h = recorded[recorded_size];
+            h.token = token;
+            h.name = name;
+            h.value = value;
+        } else {
+            recorded.push_back({ token, name, value });
+        }
+        recorded_size++;
+    }
+
+    template <typename T>
+    void flush_cookie(T&& callback) {
+        if (have_cookie) {
+            debug("combined cookie: %s\n", cookie.c_str());
+            callback(cookie_token, string("cookie"), cookie);
+            cookie.clear();
+            have_cookie = false;
+        }
+    }
 };
 
 } // namespace
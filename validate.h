@@ -0,0 +1,137 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// What scan_field found in a field. HTTP/2 requires lowercase names
+// (RFC 7540 section 8.1.2) and never allows NUL, CR or LF (section 10.3).
+enum FieldFlags {
+    FIELD_UPPERCASE = 1,
+    FIELD_FORBIDDEN = 2,
+};
+
+inline unsigned classify_byte(uint8_t c)
+{
+    return (unsigned(c - 'A') < 26 ? FIELD_UPPERCASE : 0)
+        | (c == 0 || c == '\r' || c == '\n' ? FIELD_FORBIDDEN : 0);
+}
+
+#ifdef __SSE2__
+// 16 bytes at a time: the classes of all bytes are or'ed into upper and
+// forbidden, and if asked to, the bytes are written lowercased to out.
+template <bool lowercase>
+inline void scan16(const uint8_t *p, uint8_t *out, __m128i& upper, __m128i& forbidden)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    // Bytes >= 0x80 are negative, so they're never in range.
+    __m128i u = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    __m128i f = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    upper = _mm_or_si128(upper, u);
+    forbidden = _mm_or_si128(forbidden, f);
+    if (lowercase) {
+        _mm_storeu_si128((__m128i*)out, _mm_or_si128(v, _mm_and_si128(u, _mm_set1_epi8(0x20))));
+    }
+}
+#endif
+
+// Returns the FieldFlags for the bytes of [p, p + length), and if asked to,
+// writes them lowercased to out (which may be p). Both are done in the same
+// pass, so validating a field costs about as much as copying it.
+template <bool lowercase>
+unsigned scan_field(const uint8_t *p, size_t length, uint8_t *out)
+{
+#ifdef __SSE2__
+    __m128i upper = _mm_setzero_si128();
+    __m128i forbidden = _mm_setzero_si128();
+    size_t i = 0;
+    for (; length - i >= 16; i += 16) {
+        scan16<lowercase>(p + i, lowercase ? out + i : nullptr, upper, forbidden);
+    }
+    if (i < length) {
+        // The tail goes through a padded copy rather than a byte loop, as
+        // most names are shorter than 16 bytes.
+        uint8_t buf[16];
+        memset(buf, ' ', sizeof(buf));
+        memcpy(buf, p + i, length - i);
+        scan16<lowercase>(buf, buf, upper, forbidden);
+        if (lowercase) {
+            memcpy(out + i, buf, length - i);
+        }
+    }
+    return (_mm_movemask_epi8(upper) ? FIELD_UPPERCASE : 0)
+        | (_mm_movemask_epi8(forbidden) ? FIELD_FORBIDDEN : 0);
+#else
+    unsigned flags = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned c = classify_byte(p[i]);
+        if (lowercase) {
+            out[i] = c & FIELD_UPPERCASE ? p[i] | 0x20 : p[i];
+        }
+        flags |= c;
+    }
+    return flags;
+#endif
+}
+
+inline unsigned check_field(const string& s)
+{
+    return scan_field<false>((const uint8_t*)s.data(), s.size(), nullptr);
+}
+
+// Lowercases s in place and returns the FieldFlags from before.
+inline unsigned lowercase_field(string& s)
+{
+    return scan_field<true>((const uint8_t*)s.data(), s.size(), (uint8_t*)&s[0]);
+}
+
+// Returns the name to encode for a field: name itself, or a lowercased copy
+// in lowercase if it has uppercase letters. Returns nullptr if the name is
+// empty or either string contains NUL, CR or LF.
+inline const string *normalize_field(const string& name, const string& value, string& lowercase)
+{
+    unsigned flags = check_field(name);
+    if (name.empty() || (flags & FIELD_FORBIDDEN) || (check_field(value) & FIELD_FORBIDDEN)) {
+        debug("invalid field: %s\n", name.c_str());
+        return nullptr;
+    }
+    if (!(flags & FIELD_UPPERCASE)) {
+        return &name;
+    }
+    lowercase = name;
+    lowercase_field(lowercase);
+    return &lowercase;
+}
+
+// A table profile is a file with "name: value" lines (like the input to
+// hpack) that are added to the dynamic table before the first header block.
+// The entries are checked and lowercased like fields to encode, so that
+// both ends can rely on the table holding only valid fields. Returns false
+// if the file can't be read or has an invalid field.
+inline bool read_table_profile(const char *path, HeaderList& entries)
+{
+    string contents;
+    if (!read_file(path, contents)) {
+        return false;
+    }
+    string lowercase;
+    for (const HeaderList& block : parse_header_blocks(contents)) {
+        for (Header h : block) {
+            // From a file with CRLF line ends
+            if (!h.second.empty() && h.second.back() == '\r') {
+                h.second.pop_back();
+            }
+            const string *name = normalize_field(h.first, h.second, lowercase);
+            if (!name) {
+                return false;
+            }
+            entries.push_back(Header(*name, h.second));
+        }
+    }
+    return true;
+}
+
+} // namespace